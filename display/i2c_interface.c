@@ -34,8 +34,13 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 
 #include "i2c_interface.h"
+#include "protocol.h"
+#ifndef DISPLAY_STREAM
+#include "../i2c_bus.h"
+#endif
 
 #ifdef ARDUINO
 #include "../../grbl/plugins.h"
@@ -55,14 +60,56 @@
 #endif
 #endif
 
-static uint8_t msgtype = 0; // TODO: create a queue?
-static bool connected = false;
+#ifndef DISPLAY_I2CADDRS
+#define DISPLAY_I2CADDRS { DISPLAY_I2CADDR } // displays to update, e.g. { 0x49, 0x4A } for a pendant and a tool change station
+#endif
+
+// Define DISPLAY_STREAM to a stream instance to send packets to a single display over a serial stream instead of I2C.
+// Packets are COBS framed, if KEYPAD_STREAM is the same stream keypad input is received on the same port.
+#ifdef DISPLAY_STREAM
+#ifndef DISPLAY_STREAM_BAUD
+#define DISPLAY_STREAM_BAUD 115200
+#endif
+#ifndef DISPLAY_STREAM_CODES
+#define DISPLAY_STREAM_CODES 0  // set to 1 if the display has alarm texts
+#endif
+#if MPG_ENABLE && defined(MPG_STREAM) && MPG_STREAM == DISPLAY_STREAM
+#error "The display stream cannot be shared with the MPG stream!"
+#endif
+#endif
+
+typedef enum {
+    DisplayMsg_Alarm = 0,   //!< highest priority, always sent first
+    DisplayMsg_Text,        //!< G-code message or clear message
+    DisplayMsg_Overrides,
+    DisplayMsg_WorkOffset,
+    DisplayMsg_None         //!< queue empty
+} display_msg_t;
+
+// Pending messages, one slot per message type. A new message of a type already pending
+// replaces the pending one (coalescing) but keeps its position in the queue.
+typedef struct {
+    uint8_t pending;                //!< bitmask of pending display_msg_t slots
+    uint8_t seq;                    //!< next enqueue sequence number
+    uint8_t order[DisplayMsg_None]; //!< enqueue sequence number per slot
+    alarm_code_t alarm;
+    msg_type_t text_len;            //!< text length or MachineMsg_ClearMessage
+    char text[sizeof(((machine_status_packet_t *)0)->msg)];
+} msg_queue_t;
+
+static msg_queue_t msgq = {0};
+static float wco[N_AXIS] = {0}; // work coordinate and tool length offsets in effect, refreshed on change
+static bool connected = false;  // a display is connected
+static bool attached = false;   // core hooks attached, on first display connected
+static bool updating = false;   // setup completed and display updates started
 static on_state_change_ptr on_state_change;
 static on_report_options_ptr on_report_options;
 static on_gcode_message_ptr on_gcode_message;
 static on_wco_changed_ptr on_wco_changed;
 static on_rt_reports_added_ptr on_rt_reports_added;
+static on_control_signals_changed_ptr on_control_signals_changed;
 static on_report_handlers_init_ptr on_report_handlers_init;
+static on_spindle_select_ptr on_spindle_select;
 static status_message_ptr status_message;
 //static feedback_message_ptr feedback_message;
 
@@ -75,134 +122,1079 @@ static on_jogdata_changed_ptr on_jogdata_changed;
 #define SEND_STATUS_JOG_DELAY 100
 #define SEND_STATUS_NOW_DELAY 20
 
-static machine_status_packet_t status_packet, prev_status = {0};
+#ifndef SEND_STATUS_MIN_DELAY
+#define SEND_STATUS_MIN_DELAY 40        // ms, shortest update interval during motion
+#endif
+#ifndef SEND_STATUS_IDLE_DELAY
+#define SEND_STATUS_IDLE_DELAY 1000     // ms, longest update interval when nothing changes
+#endif
+#ifndef DISPLAY_POSITION_LAG
+#define DISPLAY_POSITION_LAG 0.5f       // mm, max distance moved between updates (if bus budget allows)
+#endif
+#ifndef DISPLAY_I2C_BUDGET
+#define DISPLAY_I2C_BUDGET 25           // percent of bus or stream bandwidth the display may use
+#endif
+#ifndef DISPLAY_HEARTBEAT_INTERVAL
+#define DISPLAY_HEARTBEAT_INTERVAL 5000 // ms, full update interval while suspended, 0 to disable
+#endif
+#ifndef DISPLAY_PROBE_INTERVAL
+#define DISPLAY_PROBE_INTERVAL 100      // ms, first retry interval for displays not answering, doubled for each retry
+#endif
+#ifndef DISPLAY_PROBE_INTERVAL_MAX
+#define DISPLAY_PROBE_INTERVAL_MAX 5000 // ms, max retry interval, missing displays are probed at this interval for hot-plugging
+#endif
+#ifndef DISPLAY_OFFLINE_DROPS
+#define DISPLAY_OFFLINE_DROPS 3         // packets dropped in a row before a display is considered disconnected
+#endif
+#ifndef DISPLAY_RPM_INTERVAL
+#define DISPLAY_RPM_INTERVAL 100        // ms, spindle RPM sample interval while the spindle is on or slowing down
+#endif
+#ifndef DISPLAY_RPM_SMOOTHING
+#define DISPLAY_RPM_SMOOTHING 4         // samples, time constant of the RPM exponential average, 1 for none
+#endif
+
+static spindle_ptrs_t *spindle = NULL;  // spindle shown, cached on select
+static float spindle_rpm = 0.0f;        // smoothed, actual if the spindle can report it
+static bool rpm_sampling = false;
+
+typedef struct {
+    uint32_t interval;      // ms, current update interval
+    uint32_t window_start;  // ms
+    uint32_t packets;       // in current window
+    uint32_t bytes;         // in current window
+    uint32_t bus_time;      // us, in current window
+    float packet_rate;      // packets/s, last window
+    float byte_rate;        // bytes/s, last window
+    float utilisation;      // percent of bus time, last window
+    uint32_t update_bus_time; // us, all packets of last update
+} display_stats_t;
+
+static display_stats_t stats = { .interval = SEND_STATUS_DELAY };
+static bool suspended = false;  // polling stopped in Idle or Alarm state until an event or heartbeat
+
+#ifndef DISPLAY_TELEMETRY_INTERVAL
+#define DISPLAY_TELEMETRY_INTERVAL 0    // ms, telemetry sample interval, 0 to disable
+#endif
+#ifndef DISPLAY_TELEMETRY_SIZE
+#define DISPLAY_TELEMETRY_SIZE 64       // samples kept, must be a power of 2
+#endif
+
+#if DISPLAY_TELEMETRY_INTERVAL
+
+static_assert((DISPLAY_TELEMETRY_SIZE & (DISPLAY_TELEMETRY_SIZE - 1)) == 0, "DISPLAY_TELEMETRY_SIZE must be a power of 2");
+
+typedef struct {
+    uint32_t ms;
+    float feed_rate;            // mm/min
+    int32_t spindle_rpm;
+    uint16_t feed_override;     // percent
+    uint16_t spindle_override;  // percent
+    uint8_t rapid_override;     // percent
+    uint8_t machine_state;      // machine_state_t
+} telemetry_sample_t;
+
+// Samples are written by a single periodic task, the oldest sample is overwritten when full.
+// Readers copy samples from the sequence number of the oldest wanted, see telemetry_read().
+typedef struct {
+    volatile uint32_t head;     // sequence number of the next sample
+    telemetry_sample_t sample[DISPLAY_TELEMETRY_SIZE];
+} telemetry_t;
+
+static telemetry_t telemetry = {0};
+
+#endif
+
+// Set DISPLAY_PROTOCOL to 2 to send protocol v2 packets, requires display firmware support.
+#ifndef DISPLAY_PROTOCOL
+#ifdef DISPLAY_STREAM
+#define DISPLAY_PROTOCOL 2
+#else
+#define DISPLAY_PROTOCOL 1
+#endif
+#endif
+
+#ifndef DISPLAY_KEYFRAME_INTERVAL
+#define DISPLAY_KEYFRAME_INTERVAL 2000 // ms, max time between keyframes for protocol v2
+#endif
+#ifndef DISPLAY_CHECKED
+#define DISPLAY_CHECKED 1   // send checked packets (sequence number and CRC-8) if the display supports them
+#endif
+#ifndef DISPLAY_RETRIES
+#define DISPLAY_RETRIES 2   // max retransmissions of a packet not sent or not acknowledged
+#endif
+#ifndef DISPLAY_CHUNK_SIZE
+#define DISPLAY_CHUNK_SIZE 32 // bytes, protocol v2 messages that would make a packet longer are sent separately
+#endif
+
+#if defined(DISPLAY_STREAM) && (DISPLAY_PROTOCOL != 2 || !DISPLAY_CHECKED)
+#error "The display stream transport requires protocol v2 and checked packets!"
+#endif
+
+#if DISPLAY_PROTOCOL == 2
+typedef machine_status_t status_packet_t;
+#define STATUS_AXES N_AXIS          // the status model carries all axes, v1 packets are converted from it
+#define TX_PACKET_SIZE max(STATUS_V2_PACKET_SIZE_MAX, sizeof(machine_status_packet_t))
+#else
+typedef machine_status_packet_t status_packet_t;
+#define STATUS_AXES min(4, N_AXIS)  // protocol v1 is limited to 4 axes
+#define TX_PACKET_SIZE sizeof(machine_status_packet_t)
+#endif
+
+// Coordinate fields for axes that are not present are never sent.
+#define COORDINATE_FIELDS (0x0FUL | (0x0FUL << StatusField_CoordinateB))
+#define USED_COORDINATE_FIELDS (((1UL << min(4, N_AXIS)) - 1) | (((1UL << (max(4, N_AXIS) - 4)) - 1) << StatusField_CoordinateB))
+#define UNUSED_COORDINATE_FIELDS (COORDINATE_FIELDS & ~USED_COORDINATE_FIELDS)
+#define KEYFRAME_FIELDS (((1UL << StatusField_Count) - 1) & ~((1UL << StatusField_Message) | UNUSED_COORDINATE_FIELDS))
+#define MESSAGE_FIELD (1UL << StatusField_Message)
+// Fields present in protocol v1 packets.
+#define V1_FIELDS ((KEYFRAME_FIELDS & ~((1UL << StatusField_NumAxes) | (0x0FUL << StatusField_CoordinateB))) | MESSAGE_FIELD)
+
+static status_packet_t status_packet;
+static status_fields_t changed = 0; // fields written with a new value since the last update
+
+// Updates a status field, flags it as changed if the value differs.
+#define STATUS_SET(member, field, value) do { if(status_packet.member != (value)) { status_packet.member = (value); changed |= (1UL << (field)); } } while(0)
+
+typedef struct {
+    size_t len;
+    display_msg_t msg;  //!< message carried, requeued if the packet could not be sent
+    uint_fast8_t retries;
+    uint8_t data[TX_PACKET_SIZE];
+} tx_buffer_t;
+
+// Double buffered transmit: one buffer is assembled while the other is in flight.
+// The bus scheduler sends non-blocking and the driver reads from the buffer until the transfer completes,
+// so neither buffer may be touched until then.
+typedef struct {
+    volatile bool busy;     //!< a buffer is in flight or waiting to be retransmitted
+    bool queued;            //!< the last assembled buffer is waiting for the bus
+    uint_fast8_t next;      //!< index of buffer to assemble next
+    uint8_t seq;            //!< sequence number of next checked packet
+    tx_buffer_t *inflight;
+    tx_buffer_t buf[2];
+#if DISPLAY_PROTOCOL == 2
+    uint8_t reply[max(DISPLAY_CAPS_SIZE, DISPLAY_ACK_SIZE)]; //!< acknowledge or capabilities reply
+#endif
+} tx_buffers_t;
+
+// The status is sampled and encoded once per update, displays with the same protocol,
+// fields and message get a copy of the packet.
+typedef struct {
+    uint8_t address;
+    bool connected;
+    bool probing;                   //!< probe or capabilities request in progress
+    bool refused;                   //!< max packet size too small for protocol v2, not probed again
+    uint_fast8_t dropped;           //!< packets dropped in a row
+    status_fields_t subscribed;     //!< fields the display uses, including the message field
+    status_fields_t dirty;          //!< changed fields not yet sent
+    uint8_t msg_sent;               //!< bitmask of pending display_msg_t slots already sent
+    uint32_t sent_ms;               //!< time of last status update sent
+    uint32_t errors;                //!< packets not sent or not acknowledged
+    uint32_t retries;               //!< packets retransmitted
+#if DISPLAY_PROTOCOL == 2
+    uint_fast8_t protocol;          //!< negotiated protocol version
+    display_caps_t caps;
+    bool checked;                   //!< packets have a sequence number and CRC-8 trailer
+    bool acked;                     //!< display acknowledges checked packets
+    bool keyframe_pending;
+    bool message_postponed;         //!< send pending message in a packet of its own
+    uint32_t keyframe_ms;
+#endif
+    tx_buffers_t tx;
+} display_t;
+
+#ifdef DISPLAY_STREAM
+static const uint8_t display_address[] = { 0 };
+static const io_stream_t *stream = NULL;
+#else
+static const uint8_t display_address[] = DISPLAY_I2CADDRS;
+#endif
+
+#define N_DISPLAYS (sizeof(display_address) / sizeof(uint8_t))
+
+#ifndef DISPLAY_STREAM
+// Each display has at most one transfer queued with the bus scheduler.
+static_assert(N_DISPLAYS < I2C_BUS_QUEUE_SIZE, "too many displays for the I2C bus queue");
+#endif
+
+static display_t displays[N_DISPLAYS] = {0};
+
+// Message payload formats, displays with the same format are sent the same payload.
+#define PAYLOAD_V1 0x01     // protocol v1 layout
+#define PAYLOAD_V2 0x02     // protocol v2 layout
+#define PAYLOAD_CODES 0x04  // alarms as codes
+
+static inline uint_fast8_t payload_format (display_t *display)
+{
+#if DISPLAY_PROTOCOL == 2
+    if(display->protocol == 2)
+        return PAYLOAD_V2 | (display->caps.flags.codes ? PAYLOAD_CODES : 0);
+#endif
+
+    return PAYLOAD_V1;
+}
+
+// Returns the time in us the packet occupies the bus or stream.
+static inline uint32_t transfer_time (size_t len)
+{
+#ifdef DISPLAY_STREAM
+    return (uint32_t)(DISPLAY_COBS_SIZE(len) * 10000000ULL / DISPLAY_STREAM_BAUD); // 10 bits per character
+#else
+    return i2c_bus_time(len);
+#endif
+}
+
+#if DISPLAY_PROTOCOL == 2
+
+static_assert(N_AXIS <= STATUS_V2_AXES_MAX, "too many axes for I2C display protocol v2");
+
+// Coordinates and machine state are always sent, other fields are dropped if keyframes would not fit
+// in the display max packet size.
+#define REQUIRED_FIELDS (USED_COORDINATE_FIELDS | (1UL << StatusField_MachineState))
+
+// Selects protocol and fields to send from the display capabilities, caps_ok is false if the display
+// did not answer the capabilities request with a valid reply. Legacy displays do not and get protocol v1 packets.
+// Returns false if the required fields do not fit in the display max packet size, the display is then not updated.
+static bool negotiate_protocol (display_t *display, bool caps_ok)
+{
+    display->protocol = 1;
+    display->subscribed = V1_FIELDS;
+
+    if(caps_ok && display->caps.version >= 2) {
+
+        display->protocol = 2;
+        display->subscribed = display->caps.fields & (KEYFRAME_FIELDS | MESSAGE_FIELD);
+        display->checked = DISPLAY_CHECKED && display->caps.flags.crc;
+        display->acked = display->checked && display->caps.flags.ack;
+
+        // Keyframes and messages in a packet of their own must fit, text is truncated to fit.
+        // Optional fields are dropped from the highest numbered down until a keyframe fits,
+        // messages are not sent if the largest non-text message does not fit.
+        if(display->caps.max_packet_size) {
+
+            uint_fast8_t idx = StatusField_Count;
+            size_t size, trailer = display->checked ? STATUS_V2_TRAILER_SIZE : 0;
+            machine_status_t status = { .msgtype = MachineMsg_WorkOffset };
+
+            ((machine_wco_t *)status.msg)->n_axis = N_AXIS;
+            if(display_status_size(&status, MESSAGE_FIELD) + trailer > display->caps.max_packet_size)
+                display->subscribed &= ~MESSAGE_FIELD;
+
+            while((size = display_status_size(&status, display->subscribed & KEYFRAME_FIELDS) + trailer) > display->caps.max_packet_size && idx)
+                display->subscribed &= ~((1UL << --idx) & ~(REQUIRED_FIELDS | MESSAGE_FIELD));
+
+            if(size > display->caps.max_packet_size)
+                return false;
+        }
+    } else {
+        display->checked = display->acked = false;
+        memset(&display->caps, 0, sizeof(display_caps_t));
+    }
+
+    return true;
+}
 
-static void send_status_info (void)
+// Protocol v1 packet for legacy displays, converted from the status model.
+static size_t encode_v1 (uint8_t *buf, size_t msglen)
 {
-    uint_fast8_t idx = min(4, N_AXIS);
+    size_t len;
+    machine_status_packet_t packet;
+
+    packet.address = PacketType_Status;
+    packet.machine_state = status_packet.machine_state;
+    packet.machine_substate = status_packet.machine_substate;
+    packet.home_state = status_packet.home_state;
+    packet.feed_override = status_packet.feed_override;
+    packet.spindle_override = status_packet.spindle_override;
+    packet.spindle_stop = status_packet.spindle_stop;
+    packet.spindle_state = status_packet.spindle_state;
+    packet.spindle_rpm = status_packet.spindle_rpm;
+    packet.feed_rate = status_packet.feed_rate;
+    packet.coolant_state = status_packet.coolant_state;
+    packet.jog_mode = status_packet.jog_mode;
+    packet.signals = status_packet.signals;
+    packet.jog_stepsize = status_packet.jog_stepsize;
+    packet.current_wcs = status_packet.current_wcs;
+    packet.limits = status_packet.limits;
+    packet.status_code = status_packet.status_code;
+    packet.machine_modes = status_packet.machine_modes;
+    memcpy(packet.coordinate.values, status_packet.coordinate.values, sizeof(machine_coords_t));
+#if N_AXIS == 3
+    packet.coordinate.a = 0xFFFFFFFF;
+#endif
+    if((packet.msgtype = status_packet.msgtype) != MachineMsg_None)
+        memcpy(packet.msg, status_packet.msg, msglen);
+
+    len = packet.msgtype != MachineMsg_None ? offsetof(machine_status_packet_t, msg) + msglen : offsetof(machine_status_packet_t, msgtype);
+    memcpy(buf, &packet, len);
+
+    return len;
+}
+
+// Returns the message length or type to send, text is truncated or the message postponed if the packet
+// would exceed the display max packet size. Long messages are sent in a packet of their own to keep bus transactions short.
+static msg_type_t fit_message (display_t *display, status_fields_t *fields)
+{
+    msg_type_t msgtype = status_packet.msgtype;
+
+    if(*fields & MESSAGE_FIELD) {
+
+        uint8_t max_size = display->caps.max_packet_size;
+        size_t size = display_status_size(&status_packet, *fields) + (display->checked ? STATUS_V2_TRAILER_SIZE : 0);
+
+        if(max_size && size > max_size) {
+            if(msgtype < 128 && size - max_size < msgtype) {
+                msgtype -= size - max_size;
+                size = max_size;
+            } else
+                *fields &= ~MESSAGE_FIELD; // no room, send with next update
+        }
+
+        if(size > DISPLAY_CHUNK_SIZE && (*fields & ~MESSAGE_FIELD))
+            *fields &= ~MESSAGE_FIELD;
 
-    system_convert_array_steps_to_mpos(status_packet.coordinate.values, sys.position);
+        display->message_postponed = !(*fields & MESSAGE_FIELD);
+    }
+
+    return msgtype;
+}
+
+#endif // DISPLAY_PROTOCOL == 2
+
+// Refreshes the cached offsets, returns true if any differs from the value last cached and sent.
+static bool wco_update (void)
+{
+    bool changed = false;
+    float offset;
+    uint_fast8_t idx = N_AXIS;
 
     do {
         idx--;
-        // Apply work coordinate offsets and tool length offset to current position.
-        // TODO: figure out if realtime positions should be reported instead,
-        //       onWCOChanged() must be changed accordingly if so?
-        status_packet.coordinate.values[idx] -= gc_get_offset(idx, false);
+        if((offset = gc_get_offset(idx, true)) != wco[idx]) {
+            wco[idx] = offset;
+            changed = true;
+        }
     } while(idx);
 
-    spindle_ptrs_t *spindle = spindle_get(0);
+    return changed;
+}
 
-    status_packet.signals = hal.control.get_state();
-    status_packet.limits = limit_signals_merge(hal.limits.get_state());
-/*
-    // Report realtime feed speed
-    if(spindle->cap.variable) {
-        status_packet.spindle_rpm = spindle->param->rpm_overridden;
-        if(spindle->get_data)
-            status_packet.spindle_rpm = spindle->get_data(SpindleData_RPM)->rpm;
-    } else
-        status_packet.spindle_rpm = spindle->param->rpm;
-*/
-    status_packet.spindle_rpm = spindle->param->rpm_overridden;  //rpm should be changed to actual reading
+static void msg_enqueue (display_msg_t msg)
+{
+    uint_fast8_t idx = N_DISPLAYS;
 
-    status_packet.feed_rate = st_get_realtime_rate();
+    if(!(msgq.pending & (1 << msg))) {
+        msgq.order[msg] = msgq.seq++;
+        msgq.pending |= (1 << msg);
+    }
+
+    // New or replaced content, send to all displays.
+    do {
+        displays[--idx].msg_sent &= ~(1 << msg);
+    } while(idx);
+}
 
-    if(msgtype || memcmp(&prev_status, &status_packet, offsetof(machine_status_packet_t, msgtype))) {
+// Requeues a message for a display that did not receive it, without resending it to the others.
+static void msg_requeue (display_t *display, display_msg_t msg)
+{
+    uint_fast8_t idx = N_DISPLAYS;
 
-        size_t len = (status_packet.msgtype = msgtype) ? offsetof(machine_status_packet_t, msg) : offsetof(machine_status_packet_t, msgtype);
+    if(!(msgq.pending & (1 << msg))) {
+        msg_enqueue(msg);
+        do {
+            displays[--idx].msg_sent |= (1 << msg);
+        } while(idx);
+    }
 
-        switch(msgtype) {
+    display->msg_sent &= ~(1 << msg);
+}
 
-            case MachineMsg_None:
-            case MachineMsg_ClearMessage:
-                break;
+// Removes the message from the queue when all displays that show messages have been sent it.
+static void msg_delivered (display_msg_t msg)
+{
+    uint_fast8_t idx = N_DISPLAYS;
 
-            case MachineMsg_WorkOffset:
-                len += sizeof(machine_coords_t);
-                break;
+    do {
+        idx--;
+        if(displays[idx].connected && (displays[idx].subscribed & MESSAGE_FIELD) && !(displays[idx].msg_sent & (1 << msg)))
+            return;
+    } while(idx);
 
-            case MachineMsg_Overrides:
-                memcpy(status_packet.msg, &sys.override, sizeof(overrides_t));
-                ((overrides_t *)status_packet.msg)->spindle_rpm = spindle->param->override_pct;
-                len += sizeof(overrides_t);
-                break;
+    msgq.pending &= ~(1 << msg);
 
-            default:
-                len += status_packet.msgtype;
-                break;
-        }
+    idx = N_DISPLAYS;
+    do {
+        displays[--idx].msg_sent &= ~(1 << msg);
+    } while(idx);
+}
 
-        if(i2c_send(DISPLAY_I2CADDR, (uint8_t *)&status_packet, len, false)) {
-            memcpy(&prev_status, &status_packet, offsetof(machine_status_packet_t, msgtype));
-            msgtype = MachineMsg_None;
+// Returns the next message to send, alarms first then the oldest pending one.
+static display_msg_t msg_peek (void)
+{
+    uint_fast8_t idx, age, oldest = 0;
+    display_msg_t msg = DisplayMsg_None;
+
+    if(msgq.pending & (1 << DisplayMsg_Alarm))
+        return DisplayMsg_Alarm;
+
+    for(idx = DisplayMsg_Text; idx < DisplayMsg_None; idx++) {
+        if((msgq.pending & (1 << idx)) && (age = (uint8_t)(msgq.seq - msgq.order[idx])) > oldest) {
+            oldest = age;
+            msg = (display_msg_t)idx;
         }
     }
+
+    return msg;
 }
 
-static void set_state (sys_state_t state)
+// Sets status_packet.msgtype, copies message payload, if any, to status_packet.msg and returns its length.
+// format is the payload format of the display(s) the message is for.
+static size_t prepare_message (display_msg_t msg, uint_fast8_t format)
 {
-    status_packet.machine_substate = state_get_substate();
+    size_t len = 0;
+    uint_fast8_t idx;
 
-    switch (state) {
-        case STATE_ESTOP:
-        case STATE_ALARM:
-            {
-                status_packet.machine_state = MachineState_Alarm;
+    status_packet.msgtype = MachineMsg_None;
+
+    switch(msg) {
 
+        case DisplayMsg_Alarm:
+#if DISPLAY_PROTOCOL == 2
+            if(format & PAYLOAD_CODES) {
+                status_packet.msgtype = MachineMsg_Alarm;
+                status_packet.msg[0] = (uint8_t)msgq.alarm;
+                len = 1;
+            } else
+#endif
+            {
                 char *alarm;
-                if((alarm = (char *)alarms_get_description((alarm_code_t)status_packet.machine_substate))) {
+                if((alarm = (char *)alarms_get_description(msgq.alarm))) {
                     strncpy((char *)status_packet.msg, alarm, sizeof(status_packet.msg) - 1);
                     if((alarm = strchr((char *)status_packet.msg, '.')))
                         *(++alarm) = '\0';
                     else
                         status_packet.msg[sizeof(status_packet.msg) - 1] = '\0';
-                    msgtype = (msg_type_t)strlen((char *)status_packet.msg);
+                    len = status_packet.msgtype = (msg_type_t)strlen((char *)status_packet.msg);
                 }
             }
             break;
+
+        case DisplayMsg_Text:
+            if((status_packet.msgtype = msgq.text_len) != MachineMsg_ClearMessage)
+                memcpy(status_packet.msg, msgq.text, len = msgq.text_len);
+            break;
+
+        case DisplayMsg_WorkOffset:
+#if DISPLAY_PROTOCOL == 2
+            if(format & PAYLOAD_V2) {
+                idx = N_AXIS;
+                ((machine_wco_t *)status_packet.msg)->n_axis = N_AXIS;
+                do {
+                    idx--;
+                    ((machine_wco_t *)status_packet.msg)->offset.values[idx] = wco[idx];
+                } while(idx);
+                len = sizeof(machine_wco_t);
+            } else
+#endif
+            {
+                idx = min(4, N_AXIS);
+                do {
+                    idx--;
+                    ((machine_coords_t *)status_packet.msg)->values[idx] = wco[idx];
+                } while(idx);
+                len = sizeof(machine_coords_t);
+            }
+            status_packet.msgtype = MachineMsg_WorkOffset;
+            break;
+
+        case DisplayMsg_Overrides:
+            status_packet.msgtype = MachineMsg_Overrides;
+#if DISPLAY_PROTOCOL == 2
+            if(format & PAYLOAD_V2) {
+                ((machine_overrides_t *)status_packet.msg)->feed_rate = sys.override.feed_rate;
+                ((machine_overrides_t *)status_packet.msg)->rapid_rate = sys.override.rapid_rate;
+                ((machine_overrides_t *)status_packet.msg)->spindle_rpm = spindle->param->override_pct;
+                len = sizeof(machine_overrides_t);
+            } else
+#endif
+            {
+                memcpy(status_packet.msg, &sys.override, sizeof(overrides_t));
+                ((overrides_t *)status_packet.msg)->spindle_rpm = spindle->param->override_pct;
+                len = sizeof(overrides_t);
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    return len;
+}
+
+// Encodes the fields for the display into buf, msgtype is the message length or type to send.
+static size_t encode_packet (display_t *display, uint8_t *buf, status_fields_t fields, msg_type_t msgtype, size_t msglen)
+{
+    size_t len;
+    msg_type_t pending = status_packet.msgtype;
+
+    status_packet.msgtype = (fields & MESSAGE_FIELD) ? msgtype : MachineMsg_None;
+
+#if DISPLAY_PROTOCOL == 2
+    if(display->protocol == 2)
+        len = display_encode_status(buf, &status_packet, fields);
+    else
+        len = encode_v1(buf, msglen);
+#else
+    len = status_packet.msgtype != MachineMsg_None ? offsetof(machine_status_packet_t, msg) + msglen : offsetof(machine_status_packet_t, msgtype);
+    memcpy(buf, &status_packet, len);
+#endif
+
+    status_packet.msgtype = pending;
+
+    return len;
+}
+
+static void tx_start (display_t *display, tx_buffer_t *buf);
+static void display_resume (void);
+#ifndef DISPLAY_STREAM
+static void display_disconnect (display_t *display);
+#endif
+
+// Makes the next update to the display send all fields.
+static void force_full_update (display_t *display)
+{
+#if DISPLAY_PROTOCOL == 2
+    display->keyframe_pending = true;
+#endif
+    display->dirty |= display->subscribed & ~MESSAGE_FIELD;
+}
+
+// Starts the queued buffer, if any.
+static void tx_next (display_t *display)
+{
+    display->tx.busy = false;
+
+    if(display->tx.queued) {
+        display->tx.queued = false;
+        tx_start(display, &display->tx.buf[display->tx.next ^ 1]);
+    }
+}
+
+static void tx_retry (void *data)
+{
+    tx_start((display_t *)data, ((display_t *)data)->tx.inflight);
+}
+
+// Retransmits a packet not sent or not acknowledged, after DISPLAY_RETRIES attempts
+// the packet is dropped, its message requeued and a full update forced.
+static void tx_failed (display_t *display)
+{
+    tx_buffer_t *buf = display->tx.inflight;
+
+    display->errors++;
+
+    if(buf->retries < DISPLAY_RETRIES) {
+        buf->retries++;
+        display->retries++;
+        task_add_delayed(tx_retry, display, SEND_STATUS_NOW_DELAY);
+    } else {
+        if(buf->msg != DisplayMsg_None)
+            msg_requeue(display, buf->msg);
+#ifndef DISPLAY_STREAM
+        if(++display->dropped >= DISPLAY_OFFLINE_DROPS) {
+            display_disconnect(display);
+            return;
+        }
+#endif
+        force_full_update(display);
+        tx_next(display);
+        display_resume();
+    }
+}
+
+#if DISPLAY_PROTOCOL == 2 && !defined(DISPLAY_STREAM)
+
+// The display answers with the sequence number of the last packet received intact.
+static void tx_acknowledged (bool ok, void *context)
+{
+    display_t *display = (display_t *)context;
+
+    if(ok && display->tx.reply[0] == DISPLAY_ACK_MAGIC && display->tx.reply[1] == display->tx.inflight->data[display->tx.inflight->len - 2]) {
+        display->dropped = 0;
+        tx_next(display);
+    } else
+        tx_failed(display);
+}
+
+#endif
+
+// Called by the bus scheduler when the transfer is completed, starts the next one if queued.
+static void tx_complete (bool ok, void *context)
+{
+    display_t *display = (display_t *)context;
+
+    if(!ok)
+        tx_failed(display);
+    else {
+        display->dropped = 0;
+        tx_next(display);
+    }
+}
+
+#ifdef DISPLAY_STREAM
+
+// Frames the packet and writes it to the stream, fails if the previous frame is still being output
+// so write_n() never blocks. The stream driver outputs the frame in the background.
+static bool stream_send (const uint8_t *data, size_t len)
+{
+    static uint8_t frame[DISPLAY_COBS_SIZE(TX_PACKET_SIZE)];
+
+    if(stream->get_tx_buffer_count && stream->get_tx_buffer_count())
+        return false;
+
+    stream->write_n(frame, (uint16_t)display_cobs_encode(frame, data, len));
+
+    return true;
+}
+
+#endif
+
+static void tx_start (display_t *display, tx_buffer_t *buf)
+{
+    display->tx.busy = true;
+    display->tx.inflight = buf;
+
+#ifdef DISPLAY_STREAM
+    tx_complete(stream_send(buf->data, buf->len), display);
+#else
+    bool ok;
+
+#if DISPLAY_PROTOCOL == 2
+    // The acknowledge is read in the same bus transfer so that a keycode read from the same address cannot take it.
+    if(display->acked) {
+        display->tx.reply[0] = 0;
+        ok = i2c_bus_send_receive(I2CBus_Display, display->address, buf->data, buf->len, display->tx.reply, DISPLAY_ACK_SIZE, tx_acknowledged, display);
+    } else
+#endif
+    ok = i2c_bus_send(I2CBus_Display, display->address, buf->data, buf->len, tx_complete, display);
+
+    if(!ok)
+        tx_failed(display);
+#endif
+}
+
+// Hands an assembled buffer over for transmission, never waits for the bus.
+static void tx_submit (display_t *display, display_msg_t msg, size_t len)
+{
+    tx_buffer_t *buf = &display->tx.buf[display->tx.next];
+
+    buf->len = len;
+    buf->msg = msg;
+    buf->retries = 0;
+    display->tx.next ^= 1;
+
+    if(display->tx.busy)
+        display->tx.queued = true;
+    else
+        tx_start(display, buf);
+}
+
+// Returns the fields to send to the display in this update, 0 if none.
+// Status fields are sent no faster than the display prefers, messages are sent when pending.
+static status_fields_t get_display_fields (display_t *display, display_msg_t msg, uint32_t ms)
+{
+    status_fields_t fields = 0;
+    bool send_msg = status_packet.msgtype != MachineMsg_None && (display->subscribed & MESSAGE_FIELD) && !(display->msg_sent & (1 << msg));
+
+#if DISPLAY_PROTOCOL == 2
+    if(display->protocol == 2) {
+
+        if(ms - display->sent_ms >= display->caps.update_interval) {
+
+            if(!display->keyframe_pending)
+                display->keyframe_pending = ms - display->keyframe_ms >= DISPLAY_KEYFRAME_INTERVAL;
+
+            fields = display->keyframe_pending ? display->subscribed & KEYFRAME_FIELDS : display->dirty;
+        }
+
+        if(send_msg)
+            fields = display->message_postponed ? MESSAGE_FIELD : (fields | MESSAGE_FIELD);
+
+        return fields;
+    }
+#endif
+
+    // Protocol v1 packets always carry all status fields.
+    if(display->dirty || send_msg)
+        fields = V1_FIELDS & ~(send_msg ? 0 : MESSAGE_FIELD);
+
+    return fields;
+}
+
+// Adds the trailer if checked and hands the packet in the display next buffer over for transmission.
+// Returns the packet length.
+static size_t display_submit (display_t *display, status_fields_t fields, display_msg_t msg, size_t len, uint32_t ms)
+{
+#if DISPLAY_PROTOCOL == 2
+    if(display->checked)
+        len = display_add_trailer(display->tx.buf[display->tx.next].data, len, display->tx.seq++);
+
+    if(display->keyframe_pending && (fields & KEYFRAME_FIELDS)) {
+        display->keyframe_pending = false;
+        display->keyframe_ms = ms;
+    }
+#endif
+
+    if(fields & ~MESSAGE_FIELD) {
+        display->dirty &= ~fields;
+        display->sent_ms = ms;
+    }
+
+    if(fields & MESSAGE_FIELD)
+        display->msg_sent |= (1 << msg);
+    else
+        msg = DisplayMsg_None;
+
+    stats.packets++;
+    stats.bytes += len;
+    stats.bus_time += transfer_time(len);
+    stats.update_bus_time += transfer_time(len);
+
+    tx_submit(display, msg, len);
+
+    return len;
+}
+
+// Samples the status and sends the changes to each display, returns number of bytes sent.
+static size_t send_status_info (void)
+{
+    uint_fast8_t idx = STATUS_AXES;
+    int32_t steps[N_AXIS];
+    float position[N_AXIS];
+
+    memcpy(steps, sys.position, sizeof(steps)); // snapshot realtime position, sys.position is updated by the stepper interrupt
+    system_convert_array_steps_to_mpos(position, steps);
+
+    do {
+        idx--;
+        // Apply cached work coordinate offsets and tool length offset to current position.
+        STATUS_SET(coordinate.values[idx], STATUS_V2_COORDINATE_FIELD(idx), position[idx] - wco[idx]);
+    } while(idx);
+
+    STATUS_SET(signals.value, StatusField_Signals, hal.control.get_state().value);
+    STATUS_SET(limits.value, StatusField_Limits, limit_signals_merge(hal.limits.get_state()).value);
+    STATUS_SET(feed_rate, StatusField_FeedRate, st_get_realtime_rate());
+
+    display_msg_t msg = msg_peek();
+    uint_fast8_t payload = 0;   // format of the message payload in status_packet, prepared when needed
+    size_t msglen = 0, len, sent = 0;
+
+    status_packet.msgtype = MachineMsg_None;
+
+    status_fields_t updated = changed & KEYFRAME_FIELDS, fields[N_DISPLAYS];
+    msg_type_t msgtype[N_DISPLAYS];
+    uint32_t ms = hal.get_elapsed_ticks();
+    uint_fast8_t dst;
+    display_t *display;
+
+    changed = 0;
+    stats.update_bus_time = 0;
+
+    for(idx = 0; idx < N_DISPLAYS; idx++) {
+        display = &displays[idx];
+        fields[idx] = 0;
+        msgtype[idx] = MachineMsg_None;
+        if(display->connected) {
+            display->dirty |= updated & display->subscribed;
+            if(msg != DisplayMsg_None) {
+                if(payload_format(display) != payload)
+                    msglen = prepare_message(msg, (payload = payload_format(display)));
+                if(status_packet.msgtype == MachineMsg_None)
+                    display->msg_sent |= (1 << msg); // nothing to send, e.g. alarm without description
+            }
+            if(!display->tx.queued && (fields[idx] = get_display_fields(display, msg, ms))) {
+#if DISPLAY_PROTOCOL == 2
+                if(display->protocol == 2)
+                    msgtype[idx] = fit_message(display, &fields[idx]);
+                else
+#endif
+                msgtype[idx] = status_packet.msgtype;
+            }
+        }
+    }
+
+    // Encode once per distinct packet and copy it to the other displays it is for.
+    for(idx = 0; idx < N_DISPLAYS; idx++) {
+        if(fields[idx]) {
+            display = &displays[idx];
+            if(msg != DisplayMsg_None && payload_format(display) != payload)
+                msglen = prepare_message(msg, (payload = payload_format(display)));
+            len = encode_packet(display, display->tx.buf[display->tx.next].data, fields[idx], msgtype[idx], msglen);
+            for(dst = idx + 1; dst < N_DISPLAYS; dst++) {
+                if(fields[dst] == fields[idx] && msgtype[dst] == msgtype[idx] && payload_format(&displays[dst]) == payload_format(display)) {
+                    memcpy(displays[dst].tx.buf[displays[dst].tx.next].data, display->tx.buf[display->tx.next].data, len);
+                    sent += display_submit(&displays[dst], fields[dst], msg, len, ms);
+                    fields[dst] = 0;
+                }
+            }
+            sent += display_submit(display, fields[idx], msg, len, ms);
+        }
+    }
+
+    if(msg != DisplayMsg_None && (msgq.pending & (1 << msg)))
+        msg_delivered(msg);
+
+    return sent;
+}
+
+static machine_state_t map_state (sys_state_t state)
+{
+    machine_state_t machine_state;
+
+    switch (state) {
+        case STATE_ESTOP:
+        case STATE_ALARM:
+            machine_state = MachineState_Alarm;
+            break;
 //        case STATE_ESTOP:
-//            status_packet.machine_state = MachineState_EStop;
+//            machine_state = MachineState_EStop;
 //            break;
         case STATE_CYCLE:
-            status_packet.machine_state = MachineState_Cycle;
+            machine_state = MachineState_Cycle;
             break;
         case STATE_HOLD:
-            status_packet.machine_state = MachineState_Hold;
+            machine_state = MachineState_Hold;
             break;
         case STATE_TOOL_CHANGE:
-            status_packet.machine_state = MachineState_ToolChange;
+            machine_state = MachineState_ToolChange;
             break;
         case STATE_IDLE:
-            status_packet.machine_state = MachineState_Idle;
+            machine_state = MachineState_Idle;
             break;
         case STATE_HOMING:
-            status_packet.machine_state = MachineState_Homing;
+            machine_state = MachineState_Homing;
             break;
         case STATE_JOG:
-            status_packet.machine_state = MachineState_Jog;
+            machine_state = MachineState_Jog;
             break;
         default:
-            status_packet.machine_state = MachineState_Other;
+            machine_state = MachineState_Other;
             break;
     }
+
+    return machine_state;
+}
+
+static void set_state (sys_state_t state)
+{
+    machine_state_t machine_state = map_state(state);
+
+    STATUS_SET(machine_substate, StatusField_MachineSubstate, state_get_substate());
+
+    if(machine_state == MachineState_Alarm) {
+        msgq.alarm = (alarm_code_t)status_packet.machine_substate;
+        msg_enqueue(DisplayMsg_Alarm);
+    }
+
+    STATUS_SET(machine_state, StatusField_MachineState, machine_state);
+}
+
+static void update_stats (void)
+{
+    uint32_t ms = hal.get_elapsed_ticks(), elapsed;
+
+    if((elapsed = ms - stats.window_start) >= 1000) {
+        stats.packet_rate = (float)stats.packets * 1000.0f / (float)elapsed;
+        stats.byte_rate = (float)stats.bytes * 1000.0f / (float)elapsed;
+        stats.utilisation = (float)stats.bus_time / (float)elapsed / 10.0f;
+        stats.window_start = ms;
+        stats.packets = stats.bytes = stats.bus_time = 0;
+    }
+}
+
+// Returns true if a display has changes not yet sent, e.g. when not due or the previous update is waiting for the bus.
+static bool changes_pending (void)
+{
+    uint_fast8_t idx = N_DISPLAYS;
+
+    do {
+        idx--;
+        if(displays[idx].connected && (displays[idx].dirty || displays[idx].tx.queued))
+            return true;
+    } while(idx);
+
+    return false;
+}
+
+// Picks the next update interval from the current velocity, whether anything was sent and the bus budget.
+static uint32_t get_update_interval (size_t len)
+{
+    uint32_t interval;
+
+    if(status_packet.feed_rate > 0.0f) {
+        // Keep the distance moved between updates below DISPLAY_POSITION_LAG.
+        interval = (uint32_t)(DISPLAY_POSITION_LAG * 60000.0f / status_packet.feed_rate);
+        interval = max(min(interval, SEND_STATUS_DELAY), SEND_STATUS_MIN_DELAY);
+        //send more often during manual jogging
+        if(status_packet.machine_state == MachineState_Jog)
+            interval = min(interval, SEND_STATUS_JOG_DELAY);
+    } else if(len || changes_pending())
+        interval = status_packet.machine_state == MachineState_Jog ? SEND_STATUS_JOG_DELAY : SEND_STATUS_DELAY;
+    else // nothing changed, back off
+        interval = min(max(stats.interval, SEND_STATUS_DELAY) * 2, SEND_STATUS_IDLE_DELAY);
+
+    // Drain queued messages one per packet.
+    if(msgq.pending)
+        interval = min(interval, SEND_STATUS_NOW_DELAY);
+
+    // Stay within the bus budget: bus time / interval <= DISPLAY_I2C_BUDGET percent.
+    if(len)
+        interval = max(interval, stats.update_bus_time / (DISPLAY_I2C_BUDGET * 10));
+
+#if DISPLAY_PROTOCOL == 2
+    // Do not update faster than the fastest display prefers, slower displays skip updates until due.
+    uint_fast8_t idx = N_DISPLAYS;
+    uint32_t preferred = UINT32_MAX;
+
+    do {
+        idx--;
+        if(displays[idx].connected)
+            preferred = min(preferred, displays[idx].caps.update_interval);
+    } while(idx);
+
+    if(preferred != UINT32_MAX)
+        interval = max(interval, preferred);
+#endif
+
+    return interval;
+}
+
+// Polling may be suspended when the machine is at rest and nothing changed, changes are then
+// signalled by the core and keypad hooks calling display_resume() or display_update_now().
+static inline bool can_suspend (void)
+{
+    return (status_packet.machine_state == MachineState_Idle || status_packet.machine_state == MachineState_Alarm) &&
+            status_packet.feed_rate == 0.0f && !msgq.pending && !changes_pending();
 }
 
 static void display_update (void *data)
 {
-    send_status_info();
-    //send more often during manual jogging
-    task_add_delayed(display_update, NULL, state_get() == STATE_JOG ? SEND_STATUS_JOG_DELAY : SEND_STATUS_DELAY);
+    uint_fast8_t idx = N_DISPLAYS;
+
+    if(suspended) do { // heartbeat, resend all fields in case a display has been reset
+        force_full_update(&displays[--idx]);
+    } while(idx);
+
+    size_t len = send_status_info();
+
+    update_stats();
+
+    if((suspended = (suspended || len == 0) && can_suspend())) {
+        stats.interval = DISPLAY_HEARTBEAT_INTERVAL;
+        if(DISPLAY_HEARTBEAT_INTERVAL)
+            task_add_delayed(display_update, NULL, DISPLAY_HEARTBEAT_INTERVAL);
+    } else
+        task_add_delayed(display_update, NULL, (stats.interval = get_update_interval(len)));
+}
+
+#if DISPLAY_TELEMETRY_INTERVAL
+
+static void telemetry_sample (void *data)
+{
+    uint32_t head = telemetry.head;
+    telemetry_sample_t *sample = &telemetry.sample[head & (DISPLAY_TELEMETRY_SIZE - 1)];
+    sample->ms = hal.get_elapsed_ticks();
+    sample->feed_rate = st_get_realtime_rate();
+    sample->spindle_rpm = (int32_t)lroundf(spindle_rpm);
+    sample->feed_override = sys.override.feed_rate;
+    sample->spindle_override = spindle ? spindle->param->override_pct : 0;
+    sample->rapid_override = sys.override.rapid_rate;
+    sample->machine_state = map_state(state_get()); // sampled even when no display is attached
+
+    telemetry.head = head + 1; // publish only when complete
+
+    task_add_delayed(telemetry_sample, NULL, DISPLAY_TELEMETRY_INTERVAL);
 }
 
+// Copies up to n_max samples, oldest first, starting from sequence number *seq or the oldest sample kept if older.
+// Returns the number of samples copied and updates *seq to the sequence number of the next sample to read.
+static uint_fast16_t telemetry_read (telemetry_sample_t *samples, uint_fast16_t n_max, uint32_t *seq)
+{
+    uint32_t head = telemetry.head, from = *seq;
+    uint_fast16_t count;
+
+    if(head - from > DISPLAY_TELEMETRY_SIZE)
+        from = head - DISPLAY_TELEMETRY_SIZE;
+
+    count = min(n_max, head - from);
+
+    for(*seq = from; *seq != from + count; (*seq)++)
+        *samples++ = telemetry.sample[*seq & (DISPLAY_TELEMETRY_SIZE - 1)];
+
+    return count;
+}
+
+#endif
+
 static void display_update_now (void)
 {
+    suspended = false;
     task_delete(display_update, NULL);
     task_add_delayed(display_update, NULL, SEND_STATUS_NOW_DELAY); // wait a bit before updating in order not to spam the port
 }
 
+// Restarts polling if suspended, for hooks that do not otherwise trigger an update.
+static void display_resume (void)
+{
+    if(suspended)
+        display_update_now();
+}
+
+// Samples the spindle RPM, the actual RPM if the spindle can report it, and updates the smoothed value shown.
+// Keeps sampling while the spindle is on or the shown value has not settled.
+static void spindle_sample (void *data)
+{
+    float rpm = spindle->param->rpm;
+
+    if(spindle->cap.variable)
+        rpm = spindle->get_data ? spindle->get_data(SpindleData_RPM)->rpm : spindle->param->rpm_overridden;
+
+    spindle_rpm += (rpm - spindle_rpm) / (float)DISPLAY_RPM_SMOOTHING;
+    if(fabsf(rpm - spindle_rpm) < 1.0f)
+        spindle_rpm = rpm;
+
+    if(status_packet.spindle_rpm != (int)lroundf(spindle_rpm)) {
+        STATUS_SET(spindle_rpm, StatusField_SpindleRPM, (int)lroundf(spindle_rpm));
+        display_resume();
+    }
+
+    if((rpm_sampling = spindle->get_state(spindle).on || spindle_rpm != rpm))
+        task_add_delayed(spindle_sample, NULL, DISPLAY_RPM_INTERVAL);
+}
+
+static void spindle_sample_start (void)
+{
+    if(!rpm_sampling) {
+        rpm_sampling = true;
+        task_add_immediate(spindle_sample, NULL);
+    }
+}
+
+static bool onSpindleSelect (spindle_ptrs_t *spindle_ptrs)
+{
+    spindle = spindle_ptrs;
+    spindle_sample_start();
+
+    return on_spindle_select == NULL || on_spindle_select(spindle_ptrs);
+}
+
 static void onStateChanged (sys_state_t state)
 {
+    // Offsets in effect may change as queued motions complete, onWCOChanged() may have sampled them
+    // when the block was parsed. Resend the work offset message if so.
+    if(wco_update())
+        msg_enqueue(DisplayMsg_WorkOffset);
+
     set_state(state);
     display_update_now();
 
@@ -233,24 +1225,30 @@ static bool keypress_preview (char keycode, sys_state_t state)
 
 static void jogdata_changed (jogdata_t *jogdata)
 {
-    status_packet.jog_mode.mode = jogdata->mode;
-    status_packet.jog_mode.modifier = jogdata->modifier_index;
+    float jog_stepsize;
+    jog_mode_t jog_mode = {
+        .mode = jogdata->mode,
+        .modifier = jogdata->modifier_index
+    };
 
     switch(jogdata->mode){
 
         case JogMode_Slow:
-            status_packet.jog_stepsize = jogdata->settings.slow_speed * jogdata->modifier[jogdata->modifier_index];
+            jog_stepsize = jogdata->settings.slow_speed * jogdata->modifier[jogdata->modifier_index];
             break;
 
         case JogMode_Fast:
-            status_packet.jog_stepsize = jogdata->settings.fast_speed * jogdata->modifier[jogdata->modifier_index];
+            jog_stepsize = jogdata->settings.fast_speed * jogdata->modifier[jogdata->modifier_index];
             break;
 
         default:
-            status_packet.jog_stepsize = jogdata->settings.step_distance * jogdata->modifier[jogdata->modifier_index];
+            jog_stepsize = jogdata->settings.step_distance * jogdata->modifier[jogdata->modifier_index];
             break;
     }
 
+    STATUS_SET(jog_mode.value, StatusField_JogMode, jog_mode.value);
+    STATUS_SET(jog_stepsize, StatusField_JogStepsize, jog_stepsize);
+
     display_update_now();
 }
 
@@ -258,20 +1256,21 @@ static void jogdata_changed (jogdata_t *jogdata)
 
 static void onWCOChanged (void)
 {
-    uint_fast8_t idx = min(4, N_AXIS);
-    machine_coords_t *wco = (machine_coords_t *)status_packet.msg;
-
     if(on_wco_changed)
         on_wco_changed();
 
-    do {
-        idx--;
-        wco->values[idx] = gc_get_offset(idx, false);
-    } while(idx);
+    wco_update();
+    msg_enqueue(DisplayMsg_WorkOffset);
 
     display_update_now();
+}
+
+static void onControlSignalsChanged (control_signals_t signals)
+{
+    if(on_control_signals_changed)
+        on_control_signals_changed(signals);
 
-    msgtype = MachineMsg_WorkOffset;
+    display_resume();
 }
 
 static void onGCodeMessage (char *msg)
@@ -279,11 +1278,14 @@ static void onGCodeMessage (char *msg)
     if(on_gcode_message)
         on_gcode_message(msg);
 
-    msgtype = strlen(msg);
-    if((msgtype = min(msgtype, sizeof(status_packet.msg) - 1)) == 0)
-        msgtype = MachineMsg_ClearMessage; // empty string
+    size_t len = strlen(msg);
+
+    if((len = min(len, sizeof(msgq.text) - 1)) == 0)
+        msgq.text_len = MachineMsg_ClearMessage; // empty string
     else
-        strncpy((char *)status_packet.msg, msg, msgtype);
+        memcpy(msgq.text, msg, msgq.text_len = (msg_type_t)len);
+
+    msg_enqueue(DisplayMsg_Text);
 
     display_update_now();
 }
@@ -294,21 +1296,26 @@ static status_code_t onStatusMessageReport (status_code_t status_code)
         status_code = status_message(status_code);
 /*
     char *error;
-    if(status_code == Status_OK && status_packet.status_code != status_code)
-        msgtype = MachineMsg_ClearMessage; // empty string
+    if(status_code == Status_OK && status_packet.status_code != status_code) {
+        msgq.text_len = MachineMsg_ClearMessage; // empty string
+        msg_enqueue(DisplayMsg_Text);
 
-    else if(status_code != Status_OK &&
+    } else if(status_code != Status_OK &&
              status_code != status_packet.status_code &&
               (error = (char *)errors_get_description(status_code))) {
-        strncpy((char *)status_packet.msg, error, sizeof(status_packet.msg) - 1);
-        if((error = strchr((char *)status_packet.msg, '.')))
+        strncpy(msgq.text, error, sizeof(msgq.text) - 1);
+        if((error = strchr(msgq.text, '.')))
             *(++error) = '\0';
         else
-            status_packet.msg[sizeof(status_packet.msg) - 1] = '\0';
-        msgtype = (msg_type_t)strlen((char *)status_packet.msg);
+            msgq.text[sizeof(msgq.text) - 1] = '\0';
+        msgq.text_len = (msg_type_t)strlen(msgq.text);
+        msg_enqueue(DisplayMsg_Text);
     }
 */
-    status_packet.status_code = status_code;
+    if(status_packet.status_code != status_code) {
+        STATUS_SET(status_code, StatusField_StatusCode, status_code);
+        display_resume();
+    }
 
     return status_code;
 }
@@ -320,13 +1327,15 @@ static message_code_t onFeedbackMessageReport (message_code_t message_code)
         message_code = feedback_message(message_code);
 
     char *message;
-    if(message_code == Message_None)
-        msgtype = MachineMsg_ClearMessage; // empty string
-
-    else if((message = (char *)message_get(message_code)->text)) {
-        strncpy((char *)status_packet.msg, message, sizeof(status_packet.msg) - 1);
-        status_packet.msg[sizeof(status_packet.msg) - 1] = '\0';
-        msgtype = (msg_type_t)strlen((char *)status_packet.msg);
+    if(message_code == Message_None) {
+        msgq.text_len = MachineMsg_ClearMessage; // empty string
+        msg_enqueue(DisplayMsg_Text);
+
+    } else if((message = (char *)message_get(message_code)->text)) {
+        strncpy(msgq.text, message, sizeof(msgq.text) - 1);
+        msgq.text[sizeof(msgq.text) - 1] = '\0';
+        msgq.text_len = (msg_type_t)strlen(msgq.text);
+        msg_enqueue(DisplayMsg_Text);
     }
 
     return message_code;
@@ -335,39 +1344,43 @@ static message_code_t onFeedbackMessageReport (message_code_t message_code)
 
 static void add_reports (report_tracking_flags_t report)
 {
+    machine_modes_t modes = status_packet.machine_modes;
+
     if(report.coolant)
-        status_packet.coolant_state = hal.coolant.get_state();
+        STATUS_SET(coolant_state.value, StatusField_CoolantState, hal.coolant.get_state().value);
 
-    if(report.spindle) {
-        spindle_ptrs_t *spindle = spindle_get(0);
-        status_packet.spindle_state = spindle->get_state(spindle);
-    }
+    if(report.spindle)
+        STATUS_SET(spindle_state.value, StatusField_SpindleState, spindle->get_state(spindle).value);
+
+    if(report.spindle || report.overrides)
+        spindle_sample_start();
 
     if(report.overrides) {
-        spindle_ptrs_t *spindle = spindle_get(0);
-        msgtype = MachineMsg_Overrides;
-        status_packet.feed_override = sys.override.feed_rate > 255 ? 255 : sys.override.feed_rate;
-        status_packet.spindle_override = spindle->param->override_pct > 255 ? 255 : spindle->param->override_pct;
-        status_packet.spindle_stop = sys.override.spindle_stop.value;
+        msg_enqueue(DisplayMsg_Overrides);
+        STATUS_SET(feed_override, StatusField_FeedOverride, sys.override.feed_rate > 255 ? 255 : sys.override.feed_rate);
+        STATUS_SET(spindle_override, StatusField_SpindleOverride, spindle->param->override_pct > 255 ? 255 : spindle->param->override_pct);
+        STATUS_SET(spindle_stop, StatusField_SpindleStop, sys.override.spindle_stop.value);
     }
 
     if(report.wco)
-        status_packet.current_wcs = gc_state.modal.coord_system.id;
+        STATUS_SET(current_wcs, StatusField_CurrentWCS, gc_state.modal.coord_system.id);
 
     if(report.homed) {
         axes_signals_t homing = {sys.homing.mask ? sys.homing.mask : AXES_BITMASK};
-        status_packet.home_state.mask = sys.homing.mask & sys.homed.mask;
-        status_packet.machine_modes.homed = (homing.mask & sys.homed.mask) == homing.mask;
+        STATUS_SET(home_state.mask, StatusField_HomeState, sys.homing.mask & sys.homed.mask);
+        modes.homed = (homing.mask & sys.homed.mask) == homing.mask;
     }
 
     if(report.tlo_reference)
-        status_packet.machine_modes.tlo_referenced = sys.tlo_reference_set.mask != 0;
+        modes.tlo_referenced = sys.tlo_reference_set.mask != 0;
 
     if(report.xmode)
-        status_packet.machine_modes.diameter = gc_state.modal.diameter_mode;
+        modes.diameter = gc_state.modal.diameter_mode;
 
     if(report.mpg_mode)
-        status_packet.machine_modes.mpg = sys.mpg_mode;
+        modes.mpg = sys.mpg_mode;
+
+    STATUS_SET(machine_modes.value, StatusField_MachineModes, modes.value);
 }
 
 static void onRealtimeReportsAdded (report_tracking_flags_t report)
@@ -376,6 +1389,7 @@ static void onRealtimeReportsAdded (report_tracking_flags_t report)
         on_rt_reports_added(report);
 
     add_reports(report);
+    display_resume();
 }
 
 static void onReportHandlersInit (void)
@@ -391,12 +1405,102 @@ static void onReportHandlersInit (void)
  */
 }
 
+static status_code_t display_report_stats (sys_state_t state, char *args)
+{
+#ifndef DISPLAY_STREAM
+    static const char hex[] = "0123456789ABCDEF";
+
+    char address[] = "0x00";
+#endif
+    uint_fast8_t idx;
+
+    hal.stream.write("[DISPLAY:INTERVAL ");
+    hal.stream.write(uitoa(stats.interval));
+    hal.stream.write("ms,RATE ");
+    hal.stream.write(ftoa(stats.packet_rate, 1));
+    hal.stream.write("/s,BYTES ");
+    hal.stream.write(ftoa(stats.byte_rate, 0));
+    hal.stream.write("/s,BUS ");
+    hal.stream.write(ftoa(stats.utilisation, 1));
+    hal.stream.write(suspended ? "%,SUSPENDED]" ASCII_EOL : "%]" ASCII_EOL);
+
+    for(idx = 0; idx < N_DISPLAYS; idx++) {
+#ifdef DISPLAY_STREAM
+        hal.stream.write("[DISPLAY:STREAM ");
+        hal.stream.write(uitoa(DISPLAY_STREAM));
+#else
+        address[2] = hex[displays[idx].address >> 4];
+        address[3] = hex[displays[idx].address & 0x0F];
+        hal.stream.write("[DISPLAY:ADDRESS ");
+        hal.stream.write(address);
+#endif
+        if(displays[idx].connected) {
+            hal.stream.write(",ERRORS ");
+            hal.stream.write(uitoa(displays[idx].errors));
+            hal.stream.write(",RETRIES ");
+            hal.stream.write(uitoa(displays[idx].retries));
+#if DISPLAY_PROTOCOL == 2
+            hal.stream.write(",PROTOCOL ");
+            hal.stream.write(uitoa(displays[idx].protocol));
+            if(displays[idx].checked)
+                hal.stream.write(displays[idx].acked ? "+ACK" : "+CRC");
+            if(displays[idx].caps.flags.codes)
+                hal.stream.write("+CODES");
+#endif
+        } else
+            hal.stream.write(",NOT CONNECTED");
+        hal.stream.write("]" ASCII_EOL);
+    }
+
+    return Status_OK;
+}
+
+#if DISPLAY_TELEMETRY_INTERVAL
+
+// $TELEMETRY outputs all samples kept, $TELEMETRY=<n> the last n.
+static status_code_t display_report_telemetry (sys_state_t state, char *args)
+{
+    static const char *const state_name[] = { "Other", "Alarm", "Run", "Hold", "Tool", "Idle", "Home", "Jog" };
+
+    uint32_t seq = 0, n;
+    uint_fast8_t counter = 0;
+    telemetry_sample_t sample;
+
+    if(args) {
+        if(read_uint(args, &counter, &n) != Status_OK || n == 0)
+            return Status_BadNumberFormat;
+        seq = telemetry.head - min(n, telemetry.head);
+    }
+
+    while(telemetry_read(&sample, 1, &seq)) {
+        hal.stream.write("[TELEMETRY:");
+        hal.stream.write(uitoa(sample.ms));
+        hal.stream.write("|");
+        hal.stream.write(state_name[sample.machine_state < sizeof(state_name) / sizeof(char *) ? sample.machine_state : 0]);
+        hal.stream.write("|FS:");
+        hal.stream.write(ftoa(sample.feed_rate, 0));
+        hal.stream.write(",");
+        hal.stream.write(uitoa(sample.spindle_rpm < 0 ? 0 : (uint32_t)sample.spindle_rpm));
+        hal.stream.write("|Ov:");
+        hal.stream.write(uitoa(sample.feed_override));
+        hal.stream.write(",");
+        hal.stream.write(uitoa(sample.rapid_override));
+        hal.stream.write(",");
+        hal.stream.write(uitoa(sample.spindle_override));
+        hal.stream.write("]" ASCII_EOL);
+    }
+
+    return Status_OK;
+}
+
+#endif
+
 static void onReportOptions (bool newopt)
 {
     on_report_options(newopt);
 
     if(!newopt)
-        hal.stream.write(connected ? "[PLUGIN:I2C Display v0.11]" ASCII_EOL : "[PLUGIN:I2C Display v0.11 (not connected)]" ASCII_EOL);
+        hal.stream.write(connected ? "[PLUGIN:I2C Display v0.29]" ASCII_EOL : "[PLUGIN:I2C Display v0.29 (not connected)]" ASCII_EOL);
 }
 
 static void complete_setup (void *data)
@@ -411,60 +1515,277 @@ static void complete_setup (void *data)
         .wco = On
     };
 
+    if(spindle == NULL)
+        spindle = spindle_get(0);
+
+    wco_update();
     set_state(state_get());
     add_reports(report);
 
-    status_packet.machine_modes.mode = settings.mode;
+    machine_modes_t modes = status_packet.machine_modes;
+
+    modes.mode = settings.mode;
+    STATUS_SET(machine_modes.value, StatusField_MachineModes, modes.value);
 
+    updating = true;
+    task_delete(display_update, NULL);
     task_add_delayed(display_update, NULL, SEND_STATUS_DELAY);
 }
 
-void display_init (void)
+// Attaches the core and keypad hooks, called when the first display is connected.
+static void display_attach (void)
 {
-    on_report_options = grbl.on_report_options;
-    grbl.on_report_options = onReportOptions;
+    static const sys_command_t display_command_list[] = {
+        {"DISPLAY", display_report_stats, { .noargs = On, .allow_blocking = On }, { .str = "output I2C display update rate and bus utilisation" } }
+    };
 
-    hal.delay_ms(510, NULL);
+    static sys_commands_t display_commands = {
+        .n_commands = sizeof(display_command_list) / sizeof(sys_command_t),
+        .commands = display_command_list
+    };
 
-    if((connected = i2c_probe(DISPLAY_I2CADDR))) {
+    attached = true;
 
-        on_state_change = grbl.on_state_change;
-        grbl.on_state_change = onStateChanged;
+    on_state_change = grbl.on_state_change;
+    grbl.on_state_change = onStateChanged;
 
-        on_wco_changed = grbl.on_wco_changed;
-        grbl.on_wco_changed = onWCOChanged;
+    on_wco_changed = grbl.on_wco_changed;
+    grbl.on_wco_changed = onWCOChanged;
 
-        on_gcode_message = grbl.on_gcode_message;
-        grbl.on_gcode_message = onGCodeMessage;
+    on_gcode_message = grbl.on_gcode_message;
+    grbl.on_gcode_message = onGCodeMessage;
 
-        on_report_handlers_init = grbl.on_report_handlers_init;
-        grbl.on_report_handlers_init = onReportHandlersInit;
+    on_rt_reports_added = grbl.on_rt_reports_added;
+    grbl.on_rt_reports_added = onRealtimeReportsAdded;
 
-        on_rt_reports_added = grbl.on_rt_reports_added;
-        grbl.on_rt_reports_added = onRealtimeReportsAdded;
+    on_control_signals_changed = grbl.on_control_signals_changed;
+    grbl.on_control_signals_changed = onControlSignalsChanged;
 
-        status_packet.address = 0x01;
-        status_packet.msgtype = MachineMsg_None;
-        status_packet.status_code = Status_OK;
-    #if N_AXIS == 3
-        status_packet.coordinate.a = 0xFFFFFFFF;
-    #endif
+    status_packet.address = PacketType_Status;
+    status_packet.msgtype = MachineMsg_None;
+    status_packet.status_code = Status_OK;
+#if DISPLAY_PROTOCOL == 2
+    status_packet.n_axis = N_AXIS;
+#elif N_AXIS == 3
+    status_packet.coordinate.a = 0xFFFFFFFF;
+#endif
+
+    system_register_commands(&display_commands);
 
-        // delay final setup until startup is complete
-        protocol_enqueue_foreground_task(complete_setup, NULL);
+    // delay final setup until startup is complete
+    protocol_enqueue_foreground_task(complete_setup, NULL);
 
 #if KEYPAD_ENABLE
 
-        on_keypress_preview = keypad.on_keypress_preview;
-        keypad.on_keypress_preview = keypress_preview;
+    on_keypress_preview = keypad.on_keypress_preview;
+    keypad.on_keypress_preview = keypress_preview;
 
-        on_jogdata_changed = keypad.on_jogdata_changed;
-        keypad.on_jogdata_changed = jogdata_changed;
+    on_jogdata_changed = keypad.on_jogdata_changed;
+    keypad.on_jogdata_changed = jogdata_changed;
 
 #endif
+}
+
+// Starts updating a display that answered, the protocol has been selected.
+static void display_connect (display_t *display)
+{
+    display->probing = false;
+    display->connected = connected = true;
+    display->dropped = 0;
+    display->msg_sent = 0;
+    display->tx.busy = display->tx.queued = false;
+    force_full_update(display);
+
+    if(!attached)
+        display_attach();
+    else if(updating) { // connected later, e.g. hot-plugged, resend offsets and overrides
+        msg_enqueue(DisplayMsg_WorkOffset);
+        msg_enqueue(DisplayMsg_Overrides);
+        display_update_now();
+    }
+}
 
+#ifndef DISPLAY_STREAM
+
+static uint32_t probe_interval = DISPLAY_PROBE_INTERVAL;
+static bool probe_active = false;
+
+static void display_probe (void *data);
+
+// Restarts probing, with the shortest retry interval, if not active.
+static void probe_start (void)
+{
+    probe_interval = DISPLAY_PROBE_INTERVAL;
+
+    if(!probe_active) {
+        probe_active = true;
+        task_add_immediate(display_probe, NULL);
+    }
+}
+
+// Stops updating a display that no longer answers and probes for it to come back.
+static void display_disconnect (display_t *display)
+{
+    uint_fast8_t idx = N_DISPLAYS;
+
+    display->connected = display->tx.busy = display->tx.queued = false;
+
+    connected = false;
+    do {
+        if(displays[--idx].connected)
+            connected = true;
+    } while(idx);
+
+    probe_start();
+}
+
+#if DISPLAY_PROTOCOL == 2
+
+static void caps_received (bool ok, void *context)
+{
+    display_t *display = (display_t *)context;
+
+    if(negotiate_protocol(display, ok && display_decode_caps(display->tx.reply, DISPLAY_CAPS_SIZE, &display->caps)))
+        display_connect(display);
+    else {
+        display->probing = false;
+        display->refused = true;
+        protocol_enqueue_foreground_task(report_warning, "I2C display max packet size too small!");
+    }
+}
+
+#endif
+
+// The display answered the probe, requests its capabilities before it is connected.
+static void probe_done (bool ok, void *context)
+{
+    static bool warned = false;
+
+    display_t *display = (display_t *)context;
+
+    if(ok) {
+#if DISPLAY_PROTOCOL == 2
+        uint8_t request = PacketType_Caps;
+
+        // The reply is read in the same bus transfer so that a keycode read from the same address cannot take it.
+        display->tx.reply[0] = 0;
+        if(!i2c_bus_send_receive(I2CBus_Display, display->address, &request, 1, display->tx.reply, DISPLAY_CAPS_SIZE, caps_received, display))
+            caps_received(false, display);
+#else
+        display->subscribed = V1_FIELDS;
+        display_connect(display);
+#endif
+    } else {
+        uint_fast8_t idx = N_DISPLAYS;
+        bool found = false;
+
+        display->probing = false;
+
+        // Warn once if no display answers on startup.
+        do {
+            idx--;
+            found |= displays[idx].connected || displays[idx].probing;
+        } while(idx);
+
+        if(!found && !attached && !warned) {
+            warned = true;
+            protocol_enqueue_foreground_task(report_warning, "I2C display not connected!");
+        }
+    }
+}
+
+// Probes displays not connected, repeated with increasing interval while a display is missing
+// so that displays that are slow to start up or plugged in later are connected when they answer.
+static void display_probe (void *data)
+{
+    uint_fast8_t idx;
+    bool missing = false;
+
+    for(idx = 0; idx < N_DISPLAYS; idx++) {
+        if(!displays[idx].connected && !displays[idx].refused) {
+            missing = true;
+            if(!displays[idx].probing)
+                displays[idx].probing = i2c_bus_probe(I2CBus_Display, displays[idx].address, probe_done, &displays[idx]);
+        }
+    }
+
+    if((probe_active = missing)) {
+        task_add_delayed(display_probe, NULL, probe_interval);
+        probe_interval = min(probe_interval * 2, DISPLAY_PROBE_INTERVAL_MAX);
+    }
+}
+
+#endif // !DISPLAY_STREAM
+
+void display_init (void)
+{
+#if DISPLAY_TELEMETRY_INTERVAL
+
+    static const sys_command_t telemetry_command_list[] = {
+        {"TELEMETRY", display_report_telemetry, { .allow_blocking = On }, { .str = "output feed, spindle, override and state samples, $TELEMETRY=<n> the last n" } }
+    };
+
+    static sys_commands_t telemetry_commands = {
+        .n_commands = sizeof(telemetry_command_list) / sizeof(sys_command_t),
+        .commands = telemetry_command_list
+    };
+
+#endif
+
+    on_report_options = grbl.on_report_options;
+    grbl.on_report_options = onReportOptions;
+
+    // Chained at startup as displays are connected after the boot time report handlers init,
+    // the status code is tracked from then on.
+    on_report_handlers_init = grbl.on_report_handlers_init;
+    grbl.on_report_handlers_init = onReportHandlersInit;
+
+    // Tracked from startup so the spindle is valid when the hooks using it are attached.
+    spindle = spindle_get(0);
+
+    on_spindle_select = grbl.on_spindle_select;
+    grbl.on_spindle_select = onSpindleSelect;
+
+#if DISPLAY_TELEMETRY_INTERVAL
+    // Sampled from startup, independent of displays being connected.
+    system_register_commands(&telemetry_commands);
+    task_add_delayed(telemetry_sample, NULL, DISPLAY_TELEMETRY_INTERVAL);
+#endif
+
+#ifdef DISPLAY_STREAM
+
+    // Stream input is left to the keypad so there is no capabilities reply, a display accepting checked packets is assumed.
+    static const display_caps_t caps = {
+        .version = 2,
+        .flags.crc = On,
+        .flags.codes = DISPLAY_STREAM_CODES,
+        .fields = KEYFRAME_FIELDS | MESSAGE_FIELD
+    };
+
+#if KEYPAD_ENABLE == 2 && KEYPAD_STREAM == DISPLAY_STREAM
+    stream = keypad.stream; // shared with keypad input, opened by the keypad plugin
+#else
+    stream = stream_open_instance(DISPLAY_STREAM, DISPLAY_STREAM_BAUD, NULL, "Display");
+#endif
+
+    if(stream) {
+        memcpy(&displays[0].caps, &caps, sizeof(display_caps_t));
+        negotiate_protocol(&displays[0], true);
+        display_connect(&displays[0]);
     } else
-        protocol_enqueue_foreground_task(report_warning, "I2C display not connected!");
+        protocol_enqueue_foreground_task(report_warning, "Display stream not available!");
+
+#else
+
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < N_DISPLAYS; idx++)
+        displays[idx].address = display_address[idx];
+
+    i2c_bus_init();
+    probe_start();
+
+#endif
 }
 
 #endif // DISPLAY_ENABLE
@@ -33,12 +33,22 @@
 #define static_assert _Static_assert
 #endif
 
+typedef uint8_t packet_type_t;
 typedef uint8_t msg_type_t;
 typedef uint8_t machine_state_t;
 
+enum packet_type_t {
+    PacketType_Status = 0x01,   //!< protocol v1, full machine_status_packet_t sent as is
+    PacketType_Delta = 0x02,    //!< protocol v2, field bitmask followed by the fields present, see below
+    PacketType_Caps = 0x03      //!< capabilities request, the display answers the next read with its capabilities
+};
+
+#define PACKET_CHECKED 0x80     //!< packet type flag, the packet has a sequence number and CRC-8 trailer, see below
+
 enum msg_type_t {
     MachineMsg_None = 0,
 // 1-127 reserved for message string length
+    MachineMsg_Alarm = 252,         //!< protocol v2, alarm code for displays with the codes capability
     MachineMsg_Overrides = 253,
     MachineMsg_WorkOffset = 254,
     MachineMsg_ClearMessage = 255,
@@ -55,6 +65,7 @@ enum machine_state_t {
     MachineState_Other = 254
 };
 
+static_assert(sizeof(packet_type_t) == 1, "packet_type_t too large for I2C display interface");
 static_assert(sizeof(msg_type_t) == 1, "msg_type_t too large for I2C display interface");
 static_assert(sizeof(machine_state_t) == 1, "machine_state_t too large for I2C display interface");
 static_assert(sizeof(coord_system_id_t) == 1, "coord_system_id_t too large for I2C display interface");
@@ -89,7 +100,7 @@ typedef union {
 } machine_coords_t;
 
 typedef struct {
-    uint8_t address;
+    uint8_t address; //!< packet_type_t, always PacketType_Status for this packet
     machine_state_t machine_state;
     uint8_t machine_substate;
     axes_signals_t home_state;
@@ -111,3 +122,194 @@ typedef struct {
     msg_type_t msgtype; //<! 1 - 127 -> msg[] contains a string msgtype long
     uint8_t msg[128];
 } machine_status_packet_t;
+
+/*
+  Protocol v2 (PacketType_Delta), all multi byte values are little endian and there is no padding:
+
+    uint8_t  address;   // PacketType_Delta
+    varint   fields;    // status_fields_t bitmask, 7 bits per byte LSB first, bit 7 set if more bytes follows
+    ...                 // fields present in the bitmask, in status_field_t order and encoded as listed below
+
+  Field encodings:
+
+    coordinates       int32_t, micrometres (mm * 1000), STATUS_V2_NO_COORDINATE if not available
+    feed_rate         uint16_t, mm/min rounded, saturated at 65535
+    spindle_rpm       int32_t, RPM
+    signals           uint16_t, control_signals_t value
+    jog_stepsize      uint32_t, micrometres or mm/min * 1000 depending on jog mode
+    message           msg_type_t msgtype followed by the payload:
+                        1 - 127:                 msgtype characters of text, no terminator
+                        MachineMsg_WorkOffset:   uint8_t axis count followed by one int32_t per axis, micrometres
+                        MachineMsg_Overrides:    uint16_t feed, uint8_t rapid, uint16_t spindle (percent)
+                        MachineMsg_Alarm:        uint8_t alarm code
+                        MachineMsg_ClearMessage: no payload
+    other fields      uint8_t
+
+  Coordinates for the X, Y, Z and A axes are assigned low bits, B, C, U and V high bits after the n_axis field.
+  Coordinates for axes not present on the machine are never sent so 3 and 4 axis machines pay nothing for
+  the extra axes. n_axis is sent in keyframes.
+
+  Checked packets, PacketType_Delta | PACKET_CHECKED, have a trailer appended:
+
+    uint8_t  seq;       // incremented for each new packet, unchanged when retransmitted
+    uint8_t  crc;       // CRC-8, polynomial 0x07 and initial value 0, of all preceding bytes
+
+  Displays that advertise the ack capability answer the read following a checked packet with:
+
+    uint8_t  magic;     // DISPLAY_ACK_MAGIC
+    uint8_t  seq;       // sequence number of the last packet received intact
+
+  A keyframe is a packet with all fields present (apart from the message), it is sent at least every
+  DISPLAY_KEYFRAME_INTERVAL milliseconds so the display can resynchronise if a packet was lost.
+  Fields that change often are assigned the low bits so a typical jog update needs a single bitmask byte.
+*/
+
+typedef uint32_t status_fields_t;
+
+typedef enum {
+    StatusField_CoordinateX = 0,
+    StatusField_CoordinateY,
+    StatusField_CoordinateZ,
+    StatusField_CoordinateA,
+    StatusField_FeedRate,
+    StatusField_SpindleRPM,
+    StatusField_Message,
+    StatusField_MachineState,
+    StatusField_MachineSubstate,
+    StatusField_Signals,
+    StatusField_Limits,
+    StatusField_SpindleState,
+    StatusField_CoolantState,
+    StatusField_FeedOverride,
+    StatusField_SpindleOverride,
+    StatusField_SpindleStop,
+    StatusField_JogMode,
+    StatusField_JogStepsize,
+    StatusField_CurrentWCS,
+    StatusField_HomeState,
+    StatusField_StatusCode,
+    StatusField_MachineModes,
+    StatusField_NumAxes,
+    StatusField_CoordinateB,
+    StatusField_CoordinateC,
+    StatusField_CoordinateU,
+    StatusField_CoordinateV,
+    StatusField_Count
+} status_field_t;
+
+#define STATUS_V2_AXES_MAX 8
+
+// Status field for the coordinate of axis idx.
+#define STATUS_V2_COORDINATE_FIELD(idx) ((idx) < 4 ? StatusField_CoordinateX + (idx) : StatusField_CoordinateB + (idx) - 4)
+
+#define STATUS_V2_NO_COORDINATE INT32_MIN
+
+#define STATUS_V2_COORDINATE_SIZE 4
+#define STATUS_V2_FEED_RATE_SIZE 2
+#define STATUS_V2_SPINDLE_RPM_SIZE 4
+#define STATUS_V2_SIGNALS_SIZE 2
+#define STATUS_V2_JOG_STEPSIZE_SIZE 4
+#define STATUS_V2_OVERRIDES_SIZE 5
+#define STATUS_V2_FIELDS_SIZE (STATUS_V2_AXES_MAX * STATUS_V2_COORDINATE_SIZE + STATUS_V2_FEED_RATE_SIZE + STATUS_V2_SPINDLE_RPM_SIZE + \
+                               STATUS_V2_SIGNALS_SIZE + STATUS_V2_JOG_STEPSIZE_SIZE + 14)
+#define STATUS_V2_FIELDS_MASK_SIZE ((StatusField_Count + 6) / 7)
+#define STATUS_V2_TRAILER_SIZE 2
+#define STATUS_V2_PACKET_SIZE_MAX (1 + STATUS_V2_FIELDS_MASK_SIZE + STATUS_V2_FIELDS_SIZE + sizeof(msg_type_t) + 127 + STATUS_V2_TRAILER_SIZE)
+
+static_assert(StatusField_Count <= sizeof(status_fields_t) * 8, "status_fields_t too small for status fields");
+static_assert(STATUS_V2_FIELDS_SIZE == 58, "unexpected protocol v2 status size");
+#define STATUS_V2_WORK_OFFSET_SIZE_MAX (1 + STATUS_V2_AXES_MAX * STATUS_V2_COORDINATE_SIZE)
+
+static_assert(STATUS_V2_WORK_OFFSET_SIZE_MAX <= 127, "protocol v2 work offset payload too large");
+
+typedef union {
+    float values[STATUS_V2_AXES_MAX];
+    struct {
+        float x;
+        float y;
+        float z;
+        float a;
+        float b;
+        float c;
+        float u;
+        float v;
+    };
+} machine_coords_v2_t;
+
+// Status as encoded from and decoded to by protocol v2, field names matches machine_status_packet_t.
+typedef struct {
+    uint8_t address;
+    machine_state_t machine_state;
+    uint8_t machine_substate;
+    axes_signals_t home_state;
+    uint8_t feed_override;
+    uint8_t spindle_override;
+    uint8_t spindle_stop;
+    spindle_state_t spindle_state;
+    int32_t spindle_rpm;
+    float feed_rate;
+    coolant_state_t coolant_state;
+    jog_mode_t jog_mode;
+    control_signals_t signals;
+    float jog_stepsize;
+    coord_system_id_t current_wcs;
+    axes_signals_t limits;
+    status_code_t status_code;
+    machine_modes_t machine_modes;
+    uint8_t n_axis;
+    machine_coords_v2_t coordinate;
+    msg_type_t msgtype;
+    uint8_t msg[128];
+} machine_status_t;
+
+/*
+  Capabilities handshake: the controller writes a single PacketType_Caps byte and reads DISPLAY_CAPS_SIZE bytes back:
+
+    uint8_t  magic;             // DISPLAY_CAPS_MAGIC, legacy displays do not answer with this
+    uint8_t  version;           // highest protocol version supported
+    uint8_t  flags;             // display_caps_flags_t
+    uint8_t  max_packet_size;   // bytes including trailer, 0 if no limit
+    uint8_t  update_interval;   // preferred minimum update interval in 10 ms units, 0 if no preference
+    uint32_t fields;            // status_fields_t bitmask of the fields the display uses
+
+  Displays that do not answer with a valid reply are sent protocol v1 packets.
+  Displays with the codes flag set look up alarm texts from the alarm code and are sent alarms as
+  MachineMsg_Alarm messages, others are sent the first sentence of the alarm description as text.
+  Error texts are never sent, the status_code field carries the code of the last error.
+*/
+
+#define DISPLAY_CAPS_MAGIC 0xC7
+#define DISPLAY_CAPS_SIZE 9
+#define DISPLAY_ACK_MAGIC 0xA5
+#define DISPLAY_ACK_SIZE 2
+
+typedef union {
+    uint8_t value;
+    struct {
+        uint8_t crc    :1, //!< accepts checked packets
+                ack    :1, //!< acknowledges checked packets
+                codes  :1, //!< has alarm texts, alarms are sent as codes
+                unused :5;
+    };
+} display_caps_flags_t;
+
+typedef struct {
+    uint8_t version;
+    display_caps_flags_t flags;
+    uint8_t max_packet_size;    //!< bytes, 0 if no limit
+    uint16_t update_interval;   //!< ms, 0 if no preference
+    status_fields_t fields;
+} display_caps_t;
+
+// Decoded MachineMsg_WorkOffset payload.
+typedef struct {
+    uint8_t n_axis;
+    machine_coords_v2_t offset;
+} machine_wco_t;
+
+// Decoded MachineMsg_Overrides payload.
+typedef struct {
+    uint16_t feed_rate;
+    uint8_t rapid_rate;
+    uint16_t spindle_rpm;
+} machine_overrides_t;
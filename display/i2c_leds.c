@@ -27,86 +27,528 @@
 
 #if I2C_ENABLE && DISPLAY_ENABLE == 2
 
+#include <string.h>
+#include <assert.h>
+
+#ifdef GRBL_ESP32
+#define static_assert _Static_assert
+#endif
+
 #ifdef ARDUINO
 #include "../../grbl/plugins.h"
 #include "../../grbl/protocol.h"
+#include "../../grbl/nvs_buffer.h"
 #else
 #include "grbl/plugins.h"
 #include "grbl/protocol.h"
+#include "grbl/nvs_buffer.h"
 #endif
 
+#include "../i2c_bus.h"
+#if KEYPAD_ENABLE
+#include "../keypad.h"
+#endif
+
+// Expander types
+#define LEDS_BYTE       0 // single output byte, no registers
+#define LEDS_PCA9654E   1 // 8 outputs
+#define LEDS_PCA9555    2 // 16 outputs
+
 #ifndef DISPLAY2_PCA9654E
 #define DISPLAY2_PCA9654E 1
 #endif
 
-#if DISPLAY2_PCA9654E
+#ifndef LEDS_TYPE
+#define LEDS_TYPE (DISPLAY2_PCA9654E ? LEDS_PCA9654E : LEDS_BYTE)
+#endif
+
+#if LEDS_TYPE == LEDS_PCA9654E && !defined(LEDS_I2CADDR)
 #define LEDS_I2CADDR (0x40 >> 1)
+#endif
+
+#ifndef LEDS_I2CADDR
+#define LEDS_I2CADDR 0x49
+#endif
+
+// Additional expanders, PCA9555 unless the type is set.
+#if defined(LEDS2_I2CADDR) && !defined(LEDS2_TYPE)
+#define LEDS2_TYPE LEDS_PCA9555
+#endif
+#if defined(LEDS3_I2CADDR) && !defined(LEDS3_TYPE)
+#define LEDS3_TYPE LEDS_PCA9555
+#endif
+#if defined(LEDS4_I2CADDR) && !defined(LEDS4_TYPE)
+#define LEDS4_TYPE LEDS_PCA9555
+#endif
+
+// PCA9654E registers
 #define READ_INPUT    0
 #define RW_OUTPUT     1
 #define RW_INVERSION  2
 #define RW_CONFIG     3
+
+// PCA9555 registers, port 0 is followed by port 1
+#define PCA9555_OUTPUT      2
+#define PCA9555_INVERSION   4
+#define PCA9555_CONFIG      6
+
+// Output mapping, one character per output starting with output 0.
+#define LEDS_SIGNALS "RHSFMrgbCIADT" // signal characters in led_t order, other characters leaves the output unused
+#define LEDS_MAP_LENGTH 16
+
+#ifndef LEDS_MAP
+#define LEDS_MAP "RHSFMrgb"
+#endif
+#ifndef LEDS2_MAP
+#define LEDS2_MAP ""
+#endif
+#ifndef LEDS3_MAP
+#define LEDS3_MAP ""
 #endif
+#ifndef LEDS4_MAP
+#define LEDS4_MAP ""
+#endif
+// RGB LED colour per state, bit 0 is red, bit 1 green and bit 2 blue.
+#define LEDS_RGB_RED     0x01
+#define LEDS_RGB_GREEN   0x02
+#define LEDS_RGB_BLUE    0x04
 
-#ifndef LEDS_I2CADDR
-#define LEDS_I2CADDR 0x49
+#ifndef LEDS_RGB_IDLE
+#define LEDS_RGB_IDLE LEDS_RGB_GREEN
+#endif
+#ifndef LEDS_RGB_CYCLE
+#define LEDS_RGB_CYCLE LEDS_RGB_BLUE                        // also jogging and homing
+#endif
+#ifndef LEDS_RGB_HOLD
+#define LEDS_RGB_HOLD (LEDS_RGB_RED|LEDS_RGB_GREEN)         // also safety door open
+#endif
+#ifndef LEDS_RGB_TOOL_CHANGE
+#define LEDS_RGB_TOOL_CHANGE (LEDS_RGB_RED|LEDS_RGB_BLUE)
+#endif
+#ifndef LEDS_RGB_ALARM
+#define LEDS_RGB_ALARM LEDS_RGB_RED                         // also E-stop
+#endif
+
+// The output mapping settings, one per expander, are only registered when LEDS_SETTING_BASE is set to the first of
+// N_EXPANDERS free setting ids. The LEDS_MAP - LEDS4_MAP defaults are used otherwise.
+
+#ifndef LEDS_FLUSH_INTERVAL
+#define LEDS_FLUSH_INTERVAL 20 // ms, min interval between LED updates
+#endif
+#ifndef LEDS_PATTERN_STEP
+#define LEDS_PATTERN_STEP 125  // ms, patterns are 8 steps long
 #endif
 
+#ifndef LEDS_INPUTS
+#define LEDS_INPUTS 0           // mask of expander pins used as button inputs, PCA9654E only
+#endif
+#ifndef LEDS_INPUT_KEYS
+#define LEDS_INPUT_KEYS { 0x18, 0x19, 0x1B, 0x1A, 0x7D, 0x7C, 0x7E, 0x7F } // keycode per expander pin, default is macro keys 0 - 7
+// Macro keys 0 and 6 are reset (0x18) and cycle start (0x7E) to the keypad plugin unless the macro plugin handles them.
+#if (LEDS_INPUTS & 0x41) && !(MACROS_ENABLE && MACROS_ENABLE <= 3 && (MACROS_ENABLE & 0x02))
+#error "LEDS_INPUT_KEYS must be set when expander pin 0 or 6 is an input and the macro plugin keypad support is not enabled!"
+#elif (LEDS_INPUTS & 0x01) && defined(MACRO_KEY0)
+#error "LEDS_INPUT_KEYS must be set when expander pin 0 is an input and MACRO_KEY0 is changed!"
+#elif (LEDS_INPUTS & 0x40) && (!defined(N_MACROS) || N_MACROS < 7 || defined(MACRO_KEY6))
+#error "LEDS_INPUT_KEYS must be set when expander pin 6 is an input and macro 6 is not handled by the macro plugin!"
+#endif
+#endif
+
+#if LEDS_INPUTS
+#if LEDS_TYPE != LEDS_PCA9654E
+#error "LED expander inputs require a PCA9654E!"
+#endif
+#if !KEYPAD_ENABLE
+#error "LED expander inputs require the keypad plugin enabled!"
+#endif
+#ifndef LEDS_INPUT_PORT
+#error "LEDS_INPUT_PORT must be set to the aux input port connected to the LED expander INT output!"
+#endif
+#endif
+
+// LED patterns, bit n is the LED state in step n.
+typedef enum {
+    LedPattern_Off = 0x00,
+    LedPattern_On = 0xFF,
+    LedPattern_Blink = 0x0F,
+    LedPattern_BlinkFast = 0x55,
+    LedPattern_DoubleBlink = 0x05
+} led_pattern_t;
+
+typedef enum {
+    Led_Run = 0,
+    Led_Hold,
+    Led_Spindle,
+    Led_Flood,
+    Led_Mist,
+    Led_Red,
+    Led_Green,
+    Led_Blue,
+    Led_Cycle,
+    Led_Idle,
+    Led_Alarm,
+    Led_Door,
+    Led_ToolChange,
+    Led_Count
+} led_t;
+
+#define LEDS_STATE_SIGNALS ((1 << Led_Count) - (1 << Led_Red)) // signals only set on state changes
+
 typedef union {
-    uint8_t value;
-    struct {
-        uint8_t led0: 1,
-                led1: 1,
-                led2: 1,
-                led3: 1,
-                led4: 1,
-                led5: 1,
-                led6: 1,
-                led7: 1;
-    };
+    uint16_t value;
     struct {
-        uint8_t run:     1,
-                hold:    1,
-                spindle: 1,
-                flood:   1,
-                mist:    1,
-                red:     1,
-                green:   1,
-                blue:    1;
+        uint16_t run:         1,
+                 hold:        1,
+                 spindle:     1,
+                 flood:       1,
+                 mist:        1,
+                 red:         1,
+                 green:       1,
+                 blue:        1,
+                 cycle:       1,
+                 idle:        1,
+                 alarm:       1,
+                 door:        1,
+                 tool_change: 1,
+                 unused:      3;
     };
 } leds_t;
 
-static leds_t leds = {0};
+typedef struct {
+    uint8_t address;
+    uint8_t type;
+    bool present;
+    uint16_t outputs;               // outputs available for LEDs
+    uint16_t signal[Led_Count];     // outputs driven by each signal
+    uint16_t written;               // last written
+} expander_t;
+
+static expander_t expander[] = {
+    { .address = LEDS_I2CADDR, .type = LEDS_TYPE },
+#ifdef LEDS2_I2CADDR
+    { .address = LEDS2_I2CADDR, .type = LEDS2_TYPE },
+#endif
+#ifdef LEDS3_I2CADDR
+    { .address = LEDS3_I2CADDR, .type = LEDS3_TYPE },
+#endif
+#ifdef LEDS4_I2CADDR
+    { .address = LEDS4_I2CADDR, .type = LEDS4_TYPE },
+#endif
+};
+
+#define N_EXPANDERS (sizeof(expander) / sizeof(expander_t))
+
+// A flush queues a write per expander while an input read, two transfers, may be pending.
+// The queue holds I2C_BUS_QUEUE_SIZE - 1 transfers including the one in progress.
+static_assert(N_EXPANDERS + 2 < I2C_BUS_QUEUE_SIZE, "too many LED expanders for the I2C bus queue, increase I2C_BUS_QUEUE_SIZE");
+
+typedef struct {
+    char map[N_EXPANDERS][LEDS_MAP_LENGTH + 1];
+} leds_settings_t;
+
+static leds_t leds = {0};           // shadow, written to the expanders by leds_flush()
+static leds_t leds_flushed = {0};   // last flushed
+static leds_settings_t leds_settings;
+static volatile bool flush_pending = false;
+static uint32_t flush_ms = 0;       // time of last write
+static uint8_t pattern[Led_Count] = {0};
+static uint_fast8_t step = 0;
+static volatile bool animating = false;
 static spindle_set_state_ptr spindle_set_state_;
 static coolant_set_state_ptr coolant_set_state_;
 static on_state_change_ptr on_state_change;
 static on_report_options_ptr on_report_options;
 static on_spindle_select_ptr on_spindle_select;
 
-static void leds_write (leds_t leds)
+// Writes all outputs of the expander in a single transfer, returns false if not queued.
+static bool expander_write (expander_t *exp, uint16_t value)
 {
-#if DISPLAY2_PCA9654E
-    uint8_t cmd[2];
+    bool ok;
+    uint8_t cmd[3];
+
+    switch(exp->type) {
+
+        case LEDS_PCA9654E:
+            cmd[0] = RW_OUTPUT;
+            cmd[1] = (uint8_t)value;
+            ok = i2c_bus_send(I2CBus_Leds, exp->address, cmd, 2, NULL, NULL);
+            break;
+
+        case LEDS_PCA9555:
+            cmd[0] = PCA9555_OUTPUT;
+            cmd[1] = (uint8_t)value;
+            cmd[2] = (uint8_t)(value >> 8);
+            ok = i2c_bus_send(I2CBus_Leds, exp->address, cmd, 3, NULL, NULL);
+            break;
+
+        default:
+            cmd[0] = (uint8_t)value;
+            ok = i2c_bus_send(I2CBus_Leds, exp->address, cmd, 1, NULL, NULL);
+            break;
+    }
 
-    cmd[0] = RW_OUTPUT;
-    cmd[1] = leds.value;
+    return ok;
+}
 
-    i2c_send(LEDS_I2CADDR, cmd, 2, false);
-#else
-    i2c_send(LEDS_I2CADDR, leds.value, 1, false);
-#endif
+// Configures the expander pins in inputs as inputs and the rest as outputs.
+// The outputs are switched off by the first flush.
+static void expander_init (expander_t *exp, uint8_t inputs)
+{
+    uint8_t cmd[3];
+
+    switch(exp->type) {
+
+        case LEDS_PCA9654E:
+            exp->outputs = (uint8_t)~inputs;
+            cmd[0] = RW_CONFIG;
+            cmd[1] = inputs;
+            i2c_bus_send_blocking(I2CBus_Leds, exp->address, cmd, 2);
+            cmd[0] = RW_INVERSION;
+            cmd[1] = inputs; // inputs are pulled up, pressed buttons read as 1
+            i2c_bus_send_blocking(I2CBus_Leds, exp->address, cmd, 2);
+            break;
+
+        case LEDS_PCA9555:
+            exp->outputs = 0xFFFF;
+            cmd[0] = PCA9555_CONFIG;
+            cmd[1] = cmd[2] = 0;
+            i2c_bus_send_blocking(I2CBus_Leds, exp->address, cmd, 3);
+            cmd[0] = PCA9555_INVERSION;
+            i2c_bus_send_blocking(I2CBus_Leds, exp->address, cmd, 3);
+            break;
+
+        default:
+            exp->outputs = 0xFF;
+            break;
+    }
+
+    exp->written = exp->type == LEDS_PCA9555 ? 0xFFFF : 0xFF; // power-on output state, all high
 }
 
-static void onStateChanged (sys_state_t state)
+// Returns the expander outputs for the signal states.
+static uint16_t expander_outputs (expander_t *exp, leds_t leds)
+{
+    uint_fast8_t idx;
+    uint16_t value = 0;
+
+    for(idx = 0; idx < Led_Count; idx++) {
+        if(leds.value & (1 << idx))
+            value |= exp->signal[idx];
+    }
+
+    return value;
+}
+
+static void leds_schedule_flush (void);
+
+// Writes the outputs of each expander that has changed since last written.
+// Writes not queued, the bus queue is full, are retried by the next flush.
+static void leds_flush (void *data)
+{
+    uint_fast8_t idx;
+    uint16_t value;
+    bool retry = false;
+
+    flush_pending = false;
+    leds_flushed = leds;
+
+    for(idx = 0; idx < N_EXPANDERS; idx++) {
+        if(expander[idx].present && (value = expander_outputs(&expander[idx], leds_flushed)) != expander[idx].written) {
+            if(expander_write(&expander[idx], value))
+                expander[idx].written = value;
+            else
+                retry = true;
+            flush_ms = hal.get_elapsed_ticks();
+        }
+    }
+
+    if(retry)
+        leds_schedule_flush();
+}
+
+// Schedules a flush no sooner than LEDS_FLUSH_INTERVAL after the last write.
+static void leds_schedule_flush (void)
+{
+    if(!flush_pending) {
+        uint32_t elapsed = hal.get_elapsed_ticks() - flush_ms;
+        flush_pending = true;
+        task_add_delayed(leds_flush, NULL, elapsed >= LEDS_FLUSH_INTERVAL ? 0 : LEDS_FLUSH_INTERVAL - elapsed);
+    }
+}
+
+// Schedules a flush if the shadow register has changed.
+// Called from the wrapped HAL functions, does not touch the bus.
+static void leds_changed (void)
+{
+    if(leds.value != leds_flushed.value)
+        leds_schedule_flush();
+}
+
+#if LEDS_INPUTS
+
+static uint8_t inputs = 0, inputs_read = 0;
+static volatile bool inputs_pending = false, inputs_reread = false;
+static const char input_keys[8] = LEDS_INPUT_KEYS;
+
+static void inputs_read_start (void *data);
+
+// Issues key down/up for inputs that have changed state, pressed inputs read as 1.
+static void inputs_received (bool ok, void *context)
+{
+    if(ok) {
+
+        uint_fast8_t idx;
+        uint8_t changed = (inputs ^ inputs_read) & LEDS_INPUTS;
+
+        inputs = inputs_read;
+
+        for(idx = 0; changed; idx++) {
+            if(changed & (1 << idx)) {
+                changed &= ~(1 << idx);
+                keypad_keypress(input_keys[idx], !!(inputs & (1 << idx)));
+            }
+        }
+    }
+
+    if(!ok || inputs_reread)
+        task_add_delayed(inputs_read_start, NULL, ok ? 0 : LEDS_FLUSH_INTERVAL);
+    else
+        inputs_pending = false;
+}
+
+// Reads the input register, the expander releases its INT output when read.
+static void inputs_read_start (void *data)
+{
+    uint8_t cmd = READ_INPUT;
+
+    inputs_reread = false;
+
+    if(!(i2c_bus_send(I2CBus_Leds, LEDS_I2CADDR, &cmd, 1, NULL, NULL) &&
+          i2c_bus_receive(I2CBus_Leds, LEDS_I2CADDR, &inputs_read, 1, inputs_received, NULL)))
+        task_add_delayed(inputs_read_start, NULL, LEDS_FLUSH_INTERVAL);
+}
+
+// Expander INT asserted, an input has changed state.
+ISR_CODE static void ISR_FUNC(onInputsChanged)(uint8_t port, bool state)
 {
-    static sys_state_t last_state = STATE_IDLE;
+    if(!state) {
+        if(inputs_pending)
+            inputs_reread = true;
+        else {
+            inputs_pending = true;
+            task_add_immediate(inputs_read_start, NULL);
+        }
+    }
+}
+
+// Claims the aux input connected to the expander INT output and reads the initial input state.
+static void inputs_init (void)
+{
+    xbar_t *pin;
+    uint8_t port = LEDS_INPUT_PORT, cmd = READ_INPUT;
+
+    if((pin = ioport_get_info(Port_Digital, Port_Input, port)) && (pin->cap.irq_mode & IRQ_Mode_Falling) &&
+         ioport_claim(Port_Digital, Port_Input, &port, "LED expander INT")) {
+
+        if(pin->config) {
+            gpio_in_config_t config = {
+                .pull_mode = PullMode_Up
+            };
+            pin->config(pin, &config, false);
+        }
 
-    if(state != last_state) {
-        last_state = state;
-        leds.run = state == STATE_CYCLE;
-        leds.hold = state == STATE_HOLD;
-        leds_write(leds);
+        if(i2c_bus_send_blocking(I2CBus_Leds, LEDS_I2CADDR, &cmd, 1))
+            i2c_bus_receive_blocking(I2CBus_Leds, LEDS_I2CADDR, &inputs, 1);
+
+        if(hal.port.register_interrupt_handler(port, IRQ_Mode_Falling, onInputsChanged))
+            return;
     }
 
+    protocol_enqueue_foreground_task(report_warning, "I2C LEDs failed to claim the expander INT port!");
+}
+
+#endif // LEDS_INPUTS
+
+// Steps the patterns of blinking LEDs, runs while any LED blinks.
+static void leds_animate (void *data)
+{
+    uint_fast8_t idx;
+    bool blinking = false;
+
+    step = (step + 1) & 0x07;
+
+    for(idx = 0; idx < Led_Count; idx++) {
+        if(pattern[idx] != LedPattern_Off && pattern[idx] != LedPattern_On) {
+            blinking = true;
+            leds.value = (leds.value & ~(1 << idx)) | (((pattern[idx] >> step) & 1) << idx);
+        }
+    }
+
+    leds_changed();
+
+    if((animating = blinking))
+        task_add_delayed(leds_animate, NULL, LEDS_PATTERN_STEP);
+}
+
+// Sets the LED pattern, the LED is switched to the state of the current step immediately.
+static void led_set (led_t led, led_pattern_t led_pattern)
+{
+    pattern[led] = led_pattern;
+    leds.value = (leds.value & ~(1 << led)) | (((led_pattern >> step) & 1) << led);
+
+    if(!animating && led_pattern != LedPattern_Off && led_pattern != LedPattern_On) {
+        animating = true;
+        task_add_delayed(leds_animate, NULL, LEDS_PATTERN_STEP);
+    }
+}
+
+// Returns the RGB LED colour for the state.
+static uint_fast8_t leds_rgb (sys_state_t state)
+{
+    uint_fast8_t rgb;
+
+    if(state & (STATE_ALARM|STATE_ESTOP))
+        rgb = LEDS_RGB_ALARM;
+    else if(state & (STATE_HOLD|STATE_SAFETY_DOOR))
+        rgb = LEDS_RGB_HOLD;
+    else if(state == STATE_TOOL_CHANGE)
+        rgb = LEDS_RGB_TOOL_CHANGE;
+    else if(state == STATE_IDLE)
+        rgb = LEDS_RGB_IDLE;
+    else
+        rgb = LEDS_RGB_CYCLE;
+
+    return rgb;
+}
+
+// Run: on in cycle, blinking when jogging or homing, double blink when a tool change is pending.
+// Hold: blinking in feed hold or with the safety door open, fast blinking in alarm or E-stop.
+// The RGB colour and state predicates are steady and set in one go.
+static void onStateChanged (sys_state_t state)
+{
+    leds_t steady = {0};
+    uint_fast8_t rgb;
+
+    led_set(Led_Run, state == STATE_CYCLE ? LedPattern_On
+                      : (state & (STATE_JOG|STATE_HOMING) ? LedPattern_Blink
+                       : (state == STATE_TOOL_CHANGE ? LedPattern_DoubleBlink : LedPattern_Off)));
+    led_set(Led_Hold, state & (STATE_HOLD|STATE_SAFETY_DOOR) ? LedPattern_Blink
+                       : (state & (STATE_ALARM|STATE_ESTOP) ? LedPattern_BlinkFast : LedPattern_Off));
+
+    rgb = leds_rgb(state);
+    steady.red = !!(rgb & LEDS_RGB_RED);
+    steady.green = !!(rgb & LEDS_RGB_GREEN);
+    steady.blue = !!(rgb & LEDS_RGB_BLUE);
+    steady.cycle = state == STATE_CYCLE;
+    steady.idle = state == STATE_IDLE;
+    steady.alarm = !!(state & (STATE_ALARM|STATE_ESTOP));
+    steady.door = !!(state & STATE_SAFETY_DOOR);
+    steady.tool_change = state == STATE_TOOL_CHANGE;
+
+    leds.value = (leds.value & ~LEDS_STATE_SIGNALS) | steady.value;
+
+    leds_changed();
+
     if(on_state_change)
         on_state_change(state);
 }
@@ -115,17 +557,17 @@ static void onSpindleSetState (spindle_ptrs_t *spindle, spindle_state_t state, f
 {
     spindle_set_state_(spindle, state, rpm);
 
-    leds.spindle = state.on;
-    leds_write(leds);
+    led_set(Led_Spindle, state.on ? LedPattern_On : LedPattern_Off);
+    leds_changed();
 }
 
 static void onCoolantSetState (coolant_state_t state)
 {
     coolant_set_state_(state);
 
-    leds.flood = state.flood;
-    leds.mist = state.mist;
-    leds_write(leds);
+    led_set(Led_Flood, state.flood ? LedPattern_On : LedPattern_Off);
+    led_set(Led_Mist, state.mist ? LedPattern_On : LedPattern_Off);
+    leds_changed();
 }
 
 static bool onSpindleSelect (spindle_ptrs_t *spindle)
@@ -136,20 +578,152 @@ static bool onSpindleSelect (spindle_ptrs_t *spindle)
     return on_spindle_select == NULL || on_spindle_select(spindle);
 }
 
+// Builds the outputs driven by each signal from the mapping settings.
+static void leds_map (void)
+{
+    char *signal;
+    uint_fast8_t idx, output;
+
+    for(idx = 0; idx < N_EXPANDERS; idx++) {
+        memset(expander[idx].signal, 0, sizeof(expander[idx].signal));
+        for(output = 0; output < LEDS_MAP_LENGTH && leds_settings.map[idx][output]; output++) {
+            if((signal = strchr(LEDS_SIGNALS, leds_settings.map[idx][output])))
+                expander[idx].signal[signal - LEDS_SIGNALS] |= (1 << output) & expander[idx].outputs;
+        }
+    }
+
+    leds_schedule_flush();
+}
+
+// Sets the compile time output mappings.
+static void leds_settings_default (void)
+{
+    static const char *map[] = { LEDS_MAP, LEDS2_MAP, LEDS3_MAP, LEDS4_MAP };
+
+    uint_fast8_t idx;
+
+    memset(&leds_settings, 0, sizeof(leds_settings_t));
+
+    for(idx = 0; idx < N_EXPANDERS; idx++)
+        strncpy(leds_settings.map[idx], map[idx], LEDS_MAP_LENGTH);
+}
+
+#ifdef LEDS_SETTING_BASE
+
+static nvs_address_t nvs_address;
+
+static status_code_t leds_set_map (setting_id_t id, char *value)
+{
+    uint_fast16_t idx = id - LEDS_SETTING_BASE;
+
+    if(idx >= N_EXPANDERS)
+        return Status_Unhandled;
+
+    if(strlen(value) > (expander[idx].type == LEDS_PCA9555 ? 16 : 8))
+        return Status_SettingValueOutOfRange;
+
+    strcpy(leds_settings.map[idx], value);
+    leds_map();
+
+    return Status_OK;
+}
+
+static char *leds_get_map (setting_id_t id)
+{
+    uint_fast16_t idx = id - LEDS_SETTING_BASE;
+
+    return idx < N_EXPANDERS ? leds_settings.map[idx] : NULL;
+}
+
+static const setting_detail_t leds_settings_list[] = {
+    { LEDS_SETTING_BASE, Group_UserSettings, "LED expander ? outputs", NULL, Format_String, "x(16)", NULL, "16", Setting_NonCoreFn, leds_set_map, leds_get_map, NULL }
+};
+
+#ifndef NO_SETTINGS_DESCRIPTIONS
+
+static const setting_descr_t leds_settings_descr[] = {
+    { LEDS_SETTING_BASE, "Signal driving each expander output, starting with output 0:\n"
+                         "R run, H hold, S spindle, F flood, M mist, r, g and b RGB LED state colour,\n"
+                         "C cycle, I idle, A alarm or E-stop, D safety door open, T tool change pending. Any other character leaves the output unused." }
+};
+
+#endif
+
+static void leds_settings_save (void)
+{
+    hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&leds_settings, sizeof(leds_settings_t), true);
+}
+
+static void leds_settings_restore (void)
+{
+    leds_settings_default();
+
+    hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&leds_settings, sizeof(leds_settings_t), true);
+}
+
+static void leds_settings_load (void)
+{
+    if(hal.nvs.memcpy_from_nvs((uint8_t *)&leds_settings, nvs_address, sizeof(leds_settings_t), true) != NVS_TransferResult_OK)
+        leds_settings_restore();
+
+    leds_map();
+}
+
+static bool leds_settings_iterator (const setting_detail_t *setting, setting_output_ptr callback, void *data)
+{
+    uint_fast16_t idx;
+
+    for(idx = 0; idx < N_EXPANDERS; idx++)
+        callback(setting, idx, data);
+
+    return true;
+}
+
+#endif // LEDS_SETTING_BASE
+
 static void onReportOptions (bool newopt)
 {
     on_report_options(newopt);
 
     if(!newopt)
-        hal.stream.write("[PLUGIN:I2C LEDS v0.04]" ASCII_EOL);
+        hal.stream.write("[PLUGIN:I2C LEDS v0.11]" ASCII_EOL);
 }
 
 void display_init (void)
 {
+#ifdef LEDS_SETTING_BASE
+    static setting_details_t setting_details = {
+        .settings = leds_settings_list,
+        .n_settings = sizeof(leds_settings_list) / sizeof(setting_detail_t),
+    #ifndef NO_SETTINGS_DESCRIPTIONS
+        .descriptions = leds_settings_descr,
+        .n_descriptions = sizeof(leds_settings_descr) / sizeof(setting_descr_t),
+    #endif
+        .save = leds_settings_save,
+        .load = leds_settings_load,
+        .restore = leds_settings_restore,
+        .iterator = leds_settings_iterator
+    };
+#endif
+
+    uint_fast8_t idx, n_present = 0;
+
     on_report_options = grbl.on_report_options;
     grbl.on_report_options = onReportOptions;
 
-    if(i2c_probe(LEDS_I2CADDR)) {
+    for(idx = 0; idx < N_EXPANDERS; idx++) {
+        if((expander[idx].present = i2c_probe(expander[idx].address)))
+            n_present++;
+    }
+
+#ifdef LEDS_SETTING_BASE
+    if(n_present && !(nvs_address = nvs_alloc(sizeof(leds_settings_t))))
+        n_present = 0;
+#endif
+
+    if(n_present) {
+
+        i2c_bus_init();
 
         on_state_change = grbl.on_state_change;
         grbl.on_state_change = onStateChanged;
@@ -160,18 +734,28 @@ void display_init (void)
         coolant_set_state_ = hal.coolant.set_state;
         hal.coolant.set_state = onCoolantSetState;
 
-#if DISPLAY2_PCA9654E
-        uint8_t cmd[2];
+        for(idx = 0; idx < N_EXPANDERS; idx++) {
+            if(expander[idx].present)
+                expander_init(&expander[idx], idx == 0 ? LEDS_INPUTS : 0);
+        }
 
-        cmd[0] = RW_CONFIG;
-        cmd[1] = 0;
-        i2c_send(LEDS_I2CADDR, cmd, 2, true);
+        leds_schedule_flush();
 
-        cmd[0] = RW_INVERSION;
-        cmd[1] = 0;
-        i2c_send(LEDS_I2CADDR, cmd, 2, true);
+#ifdef LEDS_SETTING_BASE
+        settings_register(&setting_details);
+#else
+        leds_settings_default();
+        leds_map();
 #endif
 
+#if LEDS_INPUTS
+        if(expander[0].present)
+            inputs_init();
+#endif
+
+        if(n_present < N_EXPANDERS)
+            protocol_enqueue_foreground_task(report_warning, "I2C LEDs: not all expanders connected!");
+
     } else
         protocol_enqueue_foreground_task(report_warning, "I2C LEDs not connected!");
 }
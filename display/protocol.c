@@ -0,0 +1,632 @@
+/*
+  display/protocol.c - display protocol v2 encoder and decoder
+
+  Part of grblHAL keypad plugins
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef ARDUINO
+#include "../../driver.h"
+#else
+#include "driver.h"
+#endif
+
+#if DISPLAY_ENABLE == 1
+
+#include <math.h>
+#include <string.h>
+
+#include "protocol.h"
+
+// Wire size of each field, the message field has variable length and is handled separately.
+static const uint8_t field_size[] = {
+    [StatusField_CoordinateX] = STATUS_V2_COORDINATE_SIZE,
+    [StatusField_CoordinateY] = STATUS_V2_COORDINATE_SIZE,
+    [StatusField_CoordinateZ] = STATUS_V2_COORDINATE_SIZE,
+    [StatusField_CoordinateA] = STATUS_V2_COORDINATE_SIZE,
+    [StatusField_FeedRate] = STATUS_V2_FEED_RATE_SIZE,
+    [StatusField_SpindleRPM] = STATUS_V2_SPINDLE_RPM_SIZE,
+    [StatusField_Message] = 0,
+    [StatusField_MachineState] = 1,
+    [StatusField_MachineSubstate] = 1,
+    [StatusField_Signals] = STATUS_V2_SIGNALS_SIZE,
+    [StatusField_Limits] = 1,
+    [StatusField_SpindleState] = 1,
+    [StatusField_CoolantState] = 1,
+    [StatusField_FeedOverride] = 1,
+    [StatusField_SpindleOverride] = 1,
+    [StatusField_SpindleStop] = 1,
+    [StatusField_JogMode] = 1,
+    [StatusField_JogStepsize] = STATUS_V2_JOG_STEPSIZE_SIZE,
+    [StatusField_CurrentWCS] = 1,
+    [StatusField_HomeState] = 1,
+    [StatusField_StatusCode] = 1,
+    [StatusField_MachineModes] = 1,
+    [StatusField_NumAxes] = 1,
+    [StatusField_CoordinateB] = STATUS_V2_COORDINATE_SIZE,
+    [StatusField_CoordinateC] = STATUS_V2_COORDINATE_SIZE,
+    [StatusField_CoordinateU] = STATUS_V2_COORDINATE_SIZE,
+    [StatusField_CoordinateV] = STATUS_V2_COORDINATE_SIZE
+};
+
+static_assert(sizeof(field_size) == StatusField_Count, "field_size[] out of sync with status_field_t");
+
+static inline uint8_t *put_u16 (uint8_t *data, uint16_t value)
+{
+    *data++ = (uint8_t)value;
+    *data++ = (uint8_t)(value >> 8);
+
+    return data;
+}
+
+static inline uint8_t *put_u32 (uint8_t *data, uint32_t value)
+{
+    *data++ = (uint8_t)value;
+    *data++ = (uint8_t)(value >> 8);
+    *data++ = (uint8_t)(value >> 16);
+    *data++ = (uint8_t)(value >> 24);
+
+    return data;
+}
+
+static inline uint16_t get_u16 (const uint8_t *data)
+{
+    return (uint16_t)data[0] | ((uint16_t)data[1] << 8);
+}
+
+static inline uint32_t get_u32 (const uint8_t *data)
+{
+    return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+// Converts mm (or mm/min) to micrometres, rounded and saturated. NaN maps to STATUS_V2_NO_COORDINATE.
+static int32_t to_micrometres (float value)
+{
+    if(value != value)
+        return STATUS_V2_NO_COORDINATE;
+
+    if(value >= 2147483.0f)
+        return INT32_MAX;
+
+    if(value <= -2147483.0f)
+        return INT32_MIN + 1;
+
+    return (int32_t)(value * 1000.0f + (value < 0.0f ? -0.5f : 0.5f));
+}
+
+static float from_micrometres (int32_t value)
+{
+    return value == STATUS_V2_NO_COORDINATE ? NAN : (float)value / 1000.0f;
+}
+
+static uint8_t *encode_message (uint8_t *data, const machine_status_t *status)
+{
+    uint_fast8_t idx;
+
+    *data++ = status->msgtype;
+
+    switch(status->msgtype) {
+
+        case MachineMsg_None:
+        case MachineMsg_ClearMessage:
+            break;
+
+        case MachineMsg_WorkOffset:
+            *data++ = ((machine_wco_t *)status->msg)->n_axis;
+            for(idx = 0; idx < ((machine_wco_t *)status->msg)->n_axis; idx++)
+                data = put_u32(data, (uint32_t)to_micrometres(((machine_wco_t *)status->msg)->offset.values[idx]));
+            break;
+
+        case MachineMsg_Alarm:
+            *data++ = status->msg[0];
+            break;
+
+        case MachineMsg_Overrides:
+            data = put_u16(data, ((machine_overrides_t *)status->msg)->feed_rate);
+            *data++ = ((machine_overrides_t *)status->msg)->rapid_rate;
+            data = put_u16(data, ((machine_overrides_t *)status->msg)->spindle_rpm);
+            break;
+
+        default:
+            if(status->msgtype < 128) {
+                memcpy(data, status->msg, status->msgtype);
+                data += status->msgtype;
+            }
+            break;
+    }
+
+    return data;
+}
+
+static uint8_t *encode_field (uint8_t *data, const machine_status_t *status, status_field_t field)
+{
+    switch(field) {
+
+        case StatusField_CoordinateX:
+        case StatusField_CoordinateY:
+        case StatusField_CoordinateZ:
+        case StatusField_CoordinateA:
+            data = put_u32(data, (uint32_t)to_micrometres(status->coordinate.values[field - StatusField_CoordinateX]));
+            break;
+
+        case StatusField_CoordinateB:
+        case StatusField_CoordinateC:
+        case StatusField_CoordinateU:
+        case StatusField_CoordinateV:
+            data = put_u32(data, (uint32_t)to_micrometres(status->coordinate.values[field - StatusField_CoordinateB + 4]));
+            break;
+
+        case StatusField_FeedRate:
+            data = put_u16(data, status->feed_rate >= 65535.0f ? 65535 : (status->feed_rate > 0.0f ? (uint16_t)(status->feed_rate + 0.5f) : 0));
+            break;
+
+        case StatusField_SpindleRPM:
+            data = put_u32(data, (uint32_t)status->spindle_rpm);
+            break;
+
+        case StatusField_Message:
+            data = encode_message(data, status);
+            break;
+
+        case StatusField_MachineState:
+            *data++ = status->machine_state;
+            break;
+
+        case StatusField_MachineSubstate:
+            *data++ = status->machine_substate;
+            break;
+
+        case StatusField_Signals:
+            data = put_u16(data, status->signals.value);
+            break;
+
+        case StatusField_Limits:
+            *data++ = status->limits.mask;
+            break;
+
+        case StatusField_SpindleState:
+            *data++ = status->spindle_state.value;
+            break;
+
+        case StatusField_CoolantState:
+            *data++ = status->coolant_state.value;
+            break;
+
+        case StatusField_FeedOverride:
+            *data++ = status->feed_override;
+            break;
+
+        case StatusField_SpindleOverride:
+            *data++ = status->spindle_override;
+            break;
+
+        case StatusField_SpindleStop:
+            *data++ = status->spindle_stop;
+            break;
+
+        case StatusField_JogMode:
+            *data++ = status->jog_mode.value;
+            break;
+
+        case StatusField_JogStepsize:
+            data = put_u32(data, (uint32_t)to_micrometres(status->jog_stepsize));
+            break;
+
+        case StatusField_CurrentWCS:
+            *data++ = (uint8_t)status->current_wcs;
+            break;
+
+        case StatusField_HomeState:
+            *data++ = status->home_state.mask;
+            break;
+
+        case StatusField_StatusCode:
+            *data++ = (uint8_t)status->status_code;
+            break;
+
+        case StatusField_MachineModes:
+            *data++ = status->machine_modes.value;
+            break;
+
+        case StatusField_NumAxes:
+            *data++ = status->n_axis;
+            break;
+
+        default:
+            break;
+    }
+
+    return data;
+}
+
+size_t display_encode_status (uint8_t *buf, const machine_status_t *status, status_fields_t fields)
+{
+    uint_fast8_t idx;
+    uint8_t *data = buf;
+    status_fields_t mask = fields;
+
+    *data++ = PacketType_Delta;
+
+    do {
+        *data = mask & 0x7F;
+        if((mask >>= 7))
+            *data |= 0x80;
+        data++;
+    } while(mask);
+
+    for(idx = 0; fields; idx++, fields >>= 1) {
+        if(fields & 1)
+            data = encode_field(data, status, (status_field_t)idx);
+    }
+
+    return data - buf;
+}
+
+static size_t message_size (const machine_status_t *status)
+{
+    switch(status->msgtype) {
+
+        case MachineMsg_None:
+        case MachineMsg_ClearMessage:
+            return 1;
+
+        case MachineMsg_WorkOffset:
+            return 2 + ((machine_wco_t *)status->msg)->n_axis * STATUS_V2_COORDINATE_SIZE;
+
+        case MachineMsg_Alarm:
+            return 2;
+
+        case MachineMsg_Overrides:
+            return 1 + STATUS_V2_OVERRIDES_SIZE;
+
+        default:
+            return 1 + (status->msgtype < 128 ? status->msgtype : 0);
+    }
+}
+
+size_t display_status_size (const machine_status_t *status, status_fields_t fields)
+{
+    uint_fast8_t idx;
+    size_t size = 1;
+    status_fields_t mask = fields;
+
+    do {
+        size++;
+    } while((mask >>= 7));
+
+    for(idx = 0; fields; idx++, fields >>= 1) {
+        if(fields & 1)
+            size += idx == StatusField_Message ? message_size(status) : field_size[idx];
+    }
+
+    return size;
+}
+
+static bool decode_message (const uint8_t **data, const uint8_t *end, machine_status_t *status)
+{
+    uint_fast8_t idx;
+    const uint8_t *p = *data;
+
+    if(p >= end)
+        return false;
+
+    switch((status->msgtype = *p++)) {
+
+        case MachineMsg_None:
+        case MachineMsg_ClearMessage:
+            break;
+
+        case MachineMsg_WorkOffset:
+            if(p >= end || *p > STATUS_V2_AXES_MAX || end - p < 1 + *p * STATUS_V2_COORDINATE_SIZE)
+                return false;
+            ((machine_wco_t *)status->msg)->n_axis = *p++;
+            for(idx = 0; idx < STATUS_V2_AXES_MAX; idx++) {
+                if(idx < ((machine_wco_t *)status->msg)->n_axis) {
+                    ((machine_wco_t *)status->msg)->offset.values[idx] = from_micrometres((int32_t)get_u32(p));
+                    p += STATUS_V2_COORDINATE_SIZE;
+                } else
+                    ((machine_wco_t *)status->msg)->offset.values[idx] = NAN;
+            }
+            break;
+
+        case MachineMsg_Alarm:
+            if(p >= end)
+                return false;
+            status->msg[0] = *p++;
+            break;
+
+        case MachineMsg_Overrides:
+            if(end - p < STATUS_V2_OVERRIDES_SIZE)
+                return false;
+            ((machine_overrides_t *)status->msg)->feed_rate = get_u16(p);
+            ((machine_overrides_t *)status->msg)->rapid_rate = p[2];
+            ((machine_overrides_t *)status->msg)->spindle_rpm = get_u16(p + 3);
+            p += STATUS_V2_OVERRIDES_SIZE;
+            break;
+
+        default:
+            if(status->msgtype >= 128 || end - p < status->msgtype)
+                return false;
+            memcpy(status->msg, p, status->msgtype);
+            status->msg[status->msgtype] = '\0';
+            p += status->msgtype;
+            break;
+    }
+
+    *data = p;
+
+    return true;
+}
+
+bool display_decode_status (const uint8_t *buf, size_t len, machine_status_t *status, status_fields_t *fields)
+{
+    uint_fast8_t idx, shift = 0;
+    status_fields_t mask = 0;
+    const uint8_t *data = buf, *end;
+
+    if(len && *buf == (PacketType_Delta | PACKET_CHECKED)) {
+        if(!display_check_trailer(buf, len, NULL))
+            return false;
+        len -= STATUS_V2_TRAILER_SIZE;
+    }
+
+    end = buf + len;
+
+    if(len < 2 || (*data++ & ~PACKET_CHECKED) != PacketType_Delta)
+        return false;
+
+    do {
+        if(data >= end || shift >= sizeof(status_fields_t) * 8)
+            return false;
+        mask |= (status_fields_t)(*data & 0x7F) << shift;
+        shift += 7;
+    } while(*data++ & 0x80);
+
+    if(mask >> StatusField_Count)
+        return false;
+
+    if(fields)
+        *fields = mask;
+
+    status->address = PacketType_Delta;
+
+    for(idx = 0; mask; idx++, mask >>= 1) {
+
+        if(!(mask & 1))
+            continue;
+
+        if(idx == StatusField_Message) {
+            if(!decode_message(&data, end, status))
+                return false;
+            continue;
+        }
+
+        if(end - data < field_size[idx])
+            return false;
+
+        switch((status_field_t)idx) {
+
+            case StatusField_CoordinateX:
+            case StatusField_CoordinateY:
+            case StatusField_CoordinateZ:
+            case StatusField_CoordinateA:
+                status->coordinate.values[idx - StatusField_CoordinateX] = from_micrometres((int32_t)get_u32(data));
+                break;
+
+            case StatusField_CoordinateB:
+            case StatusField_CoordinateC:
+            case StatusField_CoordinateU:
+            case StatusField_CoordinateV:
+                status->coordinate.values[idx - StatusField_CoordinateB + 4] = from_micrometres((int32_t)get_u32(data));
+                break;
+
+            case StatusField_FeedRate:
+                status->feed_rate = (float)get_u16(data);
+                break;
+
+            case StatusField_SpindleRPM:
+                status->spindle_rpm = (int32_t)get_u32(data);
+                break;
+
+            case StatusField_MachineState:
+                status->machine_state = *data;
+                break;
+
+            case StatusField_MachineSubstate:
+                status->machine_substate = *data;
+                break;
+
+            case StatusField_Signals:
+                status->signals.value = get_u16(data);
+                break;
+
+            case StatusField_Limits:
+                status->limits.mask = *data;
+                break;
+
+            case StatusField_SpindleState:
+                status->spindle_state.value = *data;
+                break;
+
+            case StatusField_CoolantState:
+                status->coolant_state.value = *data;
+                break;
+
+            case StatusField_FeedOverride:
+                status->feed_override = *data;
+                break;
+
+            case StatusField_SpindleOverride:
+                status->spindle_override = *data;
+                break;
+
+            case StatusField_SpindleStop:
+                status->spindle_stop = *data;
+                break;
+
+            case StatusField_JogMode:
+                status->jog_mode.value = *data;
+                break;
+
+            case StatusField_JogStepsize:
+                status->jog_stepsize = from_micrometres((int32_t)get_u32(data));
+                break;
+
+            case StatusField_CurrentWCS:
+                status->current_wcs = (coord_system_id_t)*data;
+                break;
+
+            case StatusField_HomeState:
+                status->home_state.mask = *data;
+                break;
+
+            case StatusField_StatusCode:
+                status->status_code = (status_code_t)*data;
+                break;
+
+            case StatusField_MachineModes:
+                status->machine_modes.value = *data;
+                break;
+
+            case StatusField_NumAxes:
+                if(*data > STATUS_V2_AXES_MAX)
+                    return false;
+                status->n_axis = *data;
+                break;
+
+            default:
+                break;
+        }
+
+        data += field_size[idx];
+    }
+
+    return data == end;
+}
+
+size_t display_encode_caps (uint8_t *buf, const display_caps_t *caps)
+{
+    buf[0] = DISPLAY_CAPS_MAGIC;
+    buf[1] = caps->version;
+    buf[2] = caps->flags.value;
+    buf[3] = caps->max_packet_size;
+    buf[4] = (uint8_t)min(caps->update_interval / 10, 255);
+    put_u32(buf + 5, caps->fields);
+
+    return DISPLAY_CAPS_SIZE;
+}
+
+bool display_decode_caps (const uint8_t *buf, size_t len, display_caps_t *caps)
+{
+    if(len < DISPLAY_CAPS_SIZE || buf[0] != DISPLAY_CAPS_MAGIC || buf[1] < 1)
+        return false;
+
+    caps->version = buf[1];
+    caps->flags.value = buf[2];
+    caps->max_packet_size = buf[3];
+    caps->update_interval = buf[4] * 10;
+    caps->fields = get_u32(buf + 5);
+
+    return true;
+}
+
+uint8_t display_crc8 (const uint8_t *data, size_t len)
+{
+    // Nibble table for polynomial 0x07.
+    static const uint8_t crc_table[16] = {
+        0x00, 0x07, 0x0E, 0x09, 0x1C, 0x1B, 0x12, 0x15,
+        0x38, 0x3F, 0x36, 0x31, 0x24, 0x23, 0x2A, 0x2D
+    };
+
+    uint8_t crc = 0;
+
+    while(len--) {
+        crc ^= *data++;
+        crc = (crc << 4) ^ crc_table[crc >> 4];
+        crc = (crc << 4) ^ crc_table[crc >> 4];
+    }
+
+    return crc;
+}
+
+size_t display_add_trailer (uint8_t *buf, size_t len, uint8_t seq)
+{
+    *buf |= PACKET_CHECKED;
+    buf[len] = seq;
+    buf[len + 1] = display_crc8(buf, len + 1);
+
+    return len + STATUS_V2_TRAILER_SIZE;
+}
+
+bool display_check_trailer (const uint8_t *buf, size_t len, uint8_t *seq)
+{
+    if(len < 1 + STATUS_V2_TRAILER_SIZE || !(*buf & PACKET_CHECKED) || display_crc8(buf, len - 1) != buf[len - 1])
+        return false;
+
+    if(seq)
+        *seq = buf[len - 2];
+
+    return true;
+}
+
+size_t display_cobs_encode (uint8_t *frame, const uint8_t *data, size_t len)
+{
+    uint8_t *code = frame, *dst = frame + 1;
+
+    while(len--) {
+        if(*data == 0) {
+            *code = (uint8_t)(dst - code);
+            code = dst++;
+            data++;
+        } else {
+            *dst++ = *data++;
+            if(dst - code == 0xFF) { // max block length, start a new block without an implied zero
+                *code = 0xFF;
+                code = dst++;
+            }
+        }
+    }
+
+    *code = (uint8_t)(dst - code);
+    *dst++ = 0; // frame delimiter
+
+    return dst - frame;
+}
+
+size_t display_cobs_decode (uint8_t *data, const uint8_t *frame, size_t len)
+{
+    uint8_t code, idx;
+    uint8_t *dst = data;
+    const uint8_t *end = frame + len;
+
+    while(frame < end) {
+
+        if((code = *frame++) == 0 || code - 1 > end - frame)
+            return 0;
+
+        for(idx = 1; idx < code; idx++) {
+            if(*frame == 0)
+                return 0;
+            *dst++ = *frame++;
+        }
+
+        if(code < 0xFF && frame < end)
+            *dst++ = 0;
+    }
+
+    return dst - data;
+}
+
+#endif // DISPLAY_ENABLE
@@ -0,0 +1,61 @@
+/*
+  display/protocol.h - display protocol v2 encoder and decoder
+
+  Part of grblHAL keypad plugins
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "i2c_interface.h"
+
+// Encodes the fields in the fields bitmask into buf, returns packet length.
+// buf must be at least STATUS_V2_PACKET_SIZE_MAX bytes. If StatusField_Message is set the payload in
+// status->msg is text, machine_wco_t or machine_overrides_t depending on status->msgtype.
+size_t display_encode_status (uint8_t *buf, const machine_status_t *status, status_fields_t fields);
+
+// Decodes a packet into status, only the fields present are written. Returns false if malformed.
+// Checked packets are verified and the trailer stripped before decoding.
+// The bitmask of the fields present is returned in fields if not NULL.
+bool display_decode_status (const uint8_t *buf, size_t len, machine_status_t *status, status_fields_t *fields);
+
+// Returns the encoded length of a packet with the fields in the fields bitmask, including the message payload.
+size_t display_status_size (const machine_status_t *status, status_fields_t fields);
+
+// Encodes a capabilities reply into buf, returns DISPLAY_CAPS_SIZE.
+size_t display_encode_caps (uint8_t *buf, const display_caps_t *caps);
+
+// Decodes a capabilities reply, returns false if not valid, e.g. from a legacy display.
+bool display_decode_caps (const uint8_t *buf, size_t len, display_caps_t *caps);
+
+// CRC-8, polynomial 0x07 and initial value 0.
+uint8_t display_crc8 (const uint8_t *data, size_t len);
+
+// Converts an encoded packet to a checked packet by appending the seq and crc trailer, returns the new length.
+// buf must have room for STATUS_V2_TRAILER_SIZE more bytes.
+size_t display_add_trailer (uint8_t *buf, size_t len, uint8_t seq);
+
+// Verifies a checked packet, returns false if corrupted. The sequence number is returned in seq if not NULL.
+bool display_check_trailer (const uint8_t *buf, size_t len, uint8_t *seq);
+
+// Stream transport: packets are COBS encoded and terminated by a zero byte, the frame is at most
+// DISPLAY_COBS_SIZE(len) bytes including the delimiter.
+#define DISPLAY_COBS_SIZE(len) ((len) + (len) / 254 + 2)
+
+// Encodes a packet into frame, returns the frame length including the delimiter.
+size_t display_cobs_encode (uint8_t *frame, const uint8_t *data, size_t len);
+
+// Decodes a frame, without the delimiter, into data. Returns the packet length, 0 if malformed.
+size_t display_cobs_decode (uint8_t *data, const uint8_t *frame, size_t len);
@@ -0,0 +1,446 @@
+/*
+  i2c_bus.c - I2C bus scheduler shared by the keypad, display and LED plugins
+
+  Part of grblHAL keypad plugins
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef ARDUINO
+#include "../driver.h"
+#else
+#include "driver.h"
+#endif
+
+#if I2C_ENABLE && (KEYPAD_ENABLE == 1 || DISPLAY_ENABLE)
+
+#include <string.h>
+
+#include "i2c_bus.h"
+
+#ifdef ARDUINO
+#include "../grbl/plugins.h"
+#else
+#include "grbl/plugins.h"
+#endif
+
+typedef enum {
+    Transfer_Write = 0,
+    Transfer_Read,
+    Transfer_WriteRead,
+#if KEYPAD_ENABLE == 1
+    Transfer_Keycode,
+#endif
+    Transfer_Probe
+} transfer_type_t;
+
+typedef struct {
+    transfer_type_t type;
+    bool ok;
+    uint_fast16_t address;
+    uint8_t *data;
+    size_t len;
+    uint8_t *reply;     // Transfer_WriteRead only
+    size_t reply_len;
+    uint8_t copy[I2C_BUS_INLINE_SIZE];
+    i2c_bus_done_ptr done;
+    keycode_callback_ptr keycode;
+    void *context;
+    uint32_t queued;    // us
+} transfer_t;
+
+#define STATS_SLOT_TIME (I2C_BUS_STATS_WINDOW / I2C_BUS_STATS_SLOTS) // ms
+
+// Bus time per slot for the sliding utilisation window.
+typedef struct {
+    uint32_t slot;                              // current slot number, time / STATS_SLOT_TIME
+    uint32_t bus_time[I2C_BUS_STATS_SLOTS];     // us
+    i2c_bus_stats_t stats;
+} bus_stats_t;
+
+typedef struct {
+    volatile uint_fast8_t head;
+    volatile uint_fast8_t tail;
+    transfer_t queue[I2C_BUS_QUEUE_SIZE];
+    bus_stats_t stats;
+} bus_class_t;
+
+static bool init_ok = false;
+static volatile bool busy = false;
+#if KEYPAD_ENABLE == 1
+static keycode_callback_ptr keycode_callback = NULL;
+#endif
+static bus_class_t bus[I2CBus_Classes] = {0};
+static bus_stats_t bus_total = {0};
+
+static uint32_t get_micros (void)
+{
+    return hal.get_micros ? hal.get_micros() : hal.get_elapsed_ticks() * 1000;
+}
+
+static void bus_next (void);
+
+// Moves the utilisation window up to the current slot, the utilisation of each window completed is checked against the peak.
+static void stats_advance (bus_stats_t *stats, uint32_t slot)
+{
+    uint_fast8_t idx;
+    uint32_t bus_time;
+
+    if(slot - stats->slot > I2C_BUS_STATS_SLOTS) {
+        memset(stats->bus_time, 0, sizeof(stats->bus_time));
+        stats->slot = slot - I2C_BUS_STATS_SLOTS;
+    }
+
+    while(stats->slot != slot) {
+        for(idx = bus_time = 0; idx < I2C_BUS_STATS_SLOTS; idx++)
+            bus_time += stats->bus_time[idx];
+        stats->stats.utilisation = (float)bus_time / (I2C_BUS_STATS_WINDOW * 10.0f);
+        if(stats->stats.utilisation > stats->stats.utilisation_peak)
+            stats->stats.utilisation_peak = stats->stats.utilisation;
+        stats->bus_time[++stats->slot % I2C_BUS_STATS_SLOTS] = 0;
+    }
+}
+
+static void stats_add (bus_stats_t *stats, size_t len, bool ok)
+{
+    uint32_t bus_time = i2c_bus_time(len);
+
+    stats_advance(stats, hal.get_elapsed_ticks() / STATS_SLOT_TIME);
+
+    stats->stats.transfers++;
+    stats->stats.bytes += len;
+    stats->stats.bus_time += bus_time;
+    stats->bus_time[stats->slot % I2C_BUS_STATS_SLOTS] += bus_time;
+    if(!ok)
+        stats->stats.failures++;
+}
+
+static void stats_latency (bus_stats_t *stats, uint32_t latency)
+{
+    stats->stats.latency = latency;
+    stats->stats.latency_avg = (stats->stats.latency_avg * 7 + latency) >> 3;
+    if(latency > stats->stats.latency_max)
+        stats->stats.latency_max = latency;
+}
+
+// Called when the transfer is completed, for non-blocking transfers when it is expected to be completed
+// as the HAL does not provide a completion callback. The driver waits for a transfer in progress before starting the next.
+// The read phase of a write-then-read transfer is done here, before the bus is released, so no other
+// transfer to the same address can take the reply.
+static void bus_done (void *data)
+{
+    bus_class_t *class = (bus_class_t *)data;
+    transfer_t transfer = class->queue[class->tail];
+
+    if(transfer.type == Transfer_WriteRead && transfer.ok)
+        transfer.ok = i2c_receive(transfer.address, transfer.reply, transfer.reply_len, true);
+
+    class->tail = (class->tail + 1) & (I2C_BUS_QUEUE_SIZE - 1);
+    busy = false;
+
+    // A probe not answered is not a failure.
+    stats_add(&class->stats, transfer.len + transfer.reply_len, transfer.ok || transfer.type == Transfer_Probe);
+    stats_add(&bus_total, transfer.len + transfer.reply_len, transfer.ok || transfer.type == Transfer_Probe);
+
+    if(transfer.done)
+        transfer.done(transfer.ok, transfer.context);
+
+    bus_next();
+}
+
+#if KEYPAD_ENABLE == 1
+
+ISR_CODE static void ISR_FUNC(keycode_received)(const char c)
+{
+    if(keycode_callback)
+        keycode_callback(c);
+}
+
+#endif
+
+static void bus_start (bus_class_t *class)
+{
+    transfer_t *transfer = &class->queue[class->tail];
+    uint32_t latency = get_micros() - transfer->queued, delay = 0;
+
+    stats_latency(&class->stats, latency);
+    stats_latency(&bus_total, latency);
+
+    switch(transfer->type) {
+
+        // Short writes are sent from the queue slot and are blocking so the slot can be reused when done.
+        // Longer writes are sent in the background, completion is assumed when the wire time has passed.
+        case Transfer_Write:
+        case Transfer_WriteRead:
+            if((transfer->ok = i2c_send(transfer->address, transfer->data, transfer->len, transfer->data == transfer->copy)) && transfer->data != transfer->copy)
+                delay = i2c_bus_time(transfer->len) / 1000 + 1;
+            break;
+
+        // Blocking so the data is valid when done is called.
+        case Transfer_Read:
+            transfer->ok = i2c_receive(transfer->address, transfer->data, transfer->len, true);
+            break;
+
+#if KEYPAD_ENABLE == 1
+        case Transfer_Keycode:
+            keycode_callback = transfer->keycode;
+            i2c_get_keycode(transfer->address, keycode_received);
+            transfer->ok = true;
+            delay = i2c_bus_time(transfer->len) / 1000 + 1;
+            break;
+#endif
+
+        case Transfer_Probe:
+            transfer->ok = i2c_probe(transfer->address);
+            break;
+    }
+
+    // Complete inline if the task pool is full, the class would otherwise stay busy and stop all traffic.
+    if(!(task_add_delayed(bus_done, class, delay) || task_add_immediate(bus_done, class)))
+        bus_done(class);
+}
+
+// Starts the highest priority pending transfer if the bus is idle.
+static void bus_next (void)
+{
+    uint_fast8_t idx;
+    bus_class_t *class = NULL;
+
+    hal.irq_disable();
+
+    if(!busy) {
+        for(idx = 0; idx < I2CBus_Classes; idx++) {
+            if(bus[idx].head != bus[idx].tail) {
+                busy = true;
+                class = &bus[idx];
+                break;
+            }
+        }
+    }
+
+    hal.irq_enable();
+
+    if(class)
+        bus_start(class);
+}
+
+static bool bus_enqueue (i2c_bus_class_t cls, transfer_t *transfer)
+{
+    bool ok;
+    bus_class_t *class = &bus[cls];
+
+    hal.irq_disable();
+
+    uint_fast8_t bptr = (class->head + 1) & (I2C_BUS_QUEUE_SIZE - 1);
+
+    if((ok = bptr != class->tail)) {
+        transfer->queued = get_micros();
+        memcpy(&class->queue[class->head], transfer, sizeof(transfer_t));
+        if(transfer->data == transfer->copy)
+            class->queue[class->head].data = class->queue[class->head].copy;
+        class->head = bptr;
+    } else {
+        class->stats.stats.dropped++;
+        bus_total.stats.dropped++;
+    }
+
+    hal.irq_enable();
+
+    if(ok)
+        bus_next();
+
+    return ok;
+}
+
+bool i2c_bus_send (i2c_bus_class_t class, uint_fast16_t address, uint8_t *data, size_t len, i2c_bus_done_ptr done, void *context)
+{
+    transfer_t transfer = {
+        .type = Transfer_Write,
+        .address = address,
+        .data = data,
+        .len = len,
+        .done = done,
+        .context = context
+    };
+
+    if(len <= I2C_BUS_INLINE_SIZE)
+        memcpy(transfer.data = transfer.copy, data, len);
+
+    return bus_enqueue(class, &transfer);
+}
+
+bool i2c_bus_receive (i2c_bus_class_t class, uint_fast16_t address, uint8_t *data, size_t len, i2c_bus_done_ptr done, void *context)
+{
+    transfer_t transfer = {
+        .type = Transfer_Read,
+        .address = address,
+        .data = data,
+        .len = len,
+        .done = done,
+        .context = context
+    };
+
+    return bus_enqueue(class, &transfer);
+}
+
+bool i2c_bus_send_receive (i2c_bus_class_t class, uint_fast16_t address, uint8_t *data, size_t len, uint8_t *reply, size_t reply_len, i2c_bus_done_ptr done, void *context)
+{
+    transfer_t transfer = {
+        .type = Transfer_WriteRead,
+        .address = address,
+        .data = data,
+        .len = len,
+        .reply = reply,
+        .reply_len = reply_len,
+        .done = done,
+        .context = context
+    };
+
+    if(len <= I2C_BUS_INLINE_SIZE)
+        memcpy(transfer.data = transfer.copy, data, len);
+
+    return bus_enqueue(class, &transfer);
+}
+
+bool i2c_bus_probe (i2c_bus_class_t class, uint_fast16_t address, i2c_bus_done_ptr done, void *context)
+{
+    transfer_t transfer = {
+        .type = Transfer_Probe,
+        .address = address,
+        .done = done,
+        .context = context
+    };
+
+    return bus_enqueue(class, &transfer);
+}
+
+#if KEYPAD_ENABLE == 1
+
+static volatile bool keycode_pending = false;
+static uint_fast16_t keycode_address;
+static keycode_callback_ptr keycode_request;
+
+// Queues the keycode read requested by i2c_bus_get_keycode().
+static void keycode_enqueue (void *data)
+{
+    transfer_t transfer = {
+        .type = Transfer_Keycode,
+        .address = keycode_address,
+        .len = 1,
+        .keycode = keycode_request
+    };
+
+    keycode_pending = false;
+
+    bus_enqueue(I2CBus_Keypad, &transfer);
+}
+
+// Only records the request, the scheduler is not interrupt safe so the read is queued by a foreground task.
+// A request made while one is pending is merged with it.
+ISR_CODE bool ISR_FUNC(i2c_bus_get_keycode)(uint_fast16_t address, keycode_callback_ptr callback)
+{
+    keycode_address = address;
+    keycode_request = callback;
+
+    if(!keycode_pending)
+        keycode_pending = task_add_immediate(keycode_enqueue, NULL);
+
+    return keycode_pending;
+}
+
+#endif
+
+bool i2c_bus_send_blocking (i2c_bus_class_t class, uint_fast16_t address, uint8_t *data, size_t len)
+{
+    bool ok = i2c_send(address, data, len, true);
+
+    stats_add(&bus[class].stats, len, ok);
+    stats_add(&bus_total, len, ok);
+
+    return ok;
+}
+
+bool i2c_bus_receive_blocking (i2c_bus_class_t class, uint_fast16_t address, uint8_t *data, size_t len)
+{
+    bool ok = i2c_receive(address, data, len, true);
+
+    stats_add(&bus[class].stats, len, ok);
+    stats_add(&bus_total, len, ok);
+
+    return ok;
+}
+
+const i2c_bus_stats_t *i2c_bus_get_stats (i2c_bus_class_t class)
+{
+    bus_stats_t *stats = class < I2CBus_Classes ? &bus[class].stats : (class == I2CBus_Classes ? &bus_total : NULL);
+
+    if(stats)
+        stats_advance(stats, hal.get_elapsed_ticks() / STATS_SLOT_TIME);
+
+    return stats ? &stats->stats : NULL;
+}
+
+static status_code_t i2c_bus_report_stats (sys_state_t state, char *args)
+{
+    static const char *const names[I2CBus_Classes + 1] = { "KEYPAD", "LEDS", "DISPLAY", "BUS" };
+
+    uint_fast8_t idx;
+    const i2c_bus_stats_t *stats;
+
+    for(idx = 0; idx <= I2CBus_Classes; idx++) {
+        stats = i2c_bus_get_stats((i2c_bus_class_t)idx);
+        hal.stream.write("[I2C:");
+        hal.stream.write(names[idx]);
+        hal.stream.write(" ");
+        hal.stream.write(uitoa(stats->transfers));
+        hal.stream.write(",BYTES ");
+        hal.stream.write(uitoa(stats->bytes));
+        hal.stream.write(",FAILED ");
+        hal.stream.write(uitoa(stats->failures));
+        hal.stream.write(",TIME ");
+        hal.stream.write(uitoa((uint32_t)(stats->bus_time / 1000)));
+        hal.stream.write("ms,LOAD ");
+        hal.stream.write(ftoa(stats->utilisation, 1));
+        hal.stream.write("%,PEAK ");
+        hal.stream.write(ftoa(stats->utilisation_peak, 1));
+        hal.stream.write("%,LATENCY ");
+        hal.stream.write(uitoa(stats->latency_avg));
+        hal.stream.write("us,MAX ");
+        hal.stream.write(uitoa(stats->latency_max));
+        hal.stream.write("us,DROPPED ");
+        hal.stream.write(uitoa(stats->dropped));
+        hal.stream.write("]" ASCII_EOL);
+    }
+
+    return Status_OK;
+}
+
+void i2c_bus_init (void)
+{
+    static const sys_command_t i2c_bus_command_list[] = {
+        {"I2C", i2c_bus_report_stats, { .noargs = On, .allow_blocking = On }, { .str = "output I2C bus transfers, bytes, failures, utilisation and latency per class" } }
+    };
+
+    static sys_commands_t i2c_bus_commands = {
+        .n_commands = sizeof(i2c_bus_command_list) / sizeof(sys_command_t),
+        .commands = i2c_bus_command_list
+    };
+
+    if(!init_ok) {
+        init_ok = true;
+        system_register_commands(&i2c_bus_commands);
+    }
+}
+
+#endif
@@ -0,0 +1,98 @@
+/*
+  i2c_bus.h - I2C bus scheduler shared by the keypad, display and LED plugins
+
+  Part of grblHAL keypad plugins
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _I2C_BUS_H_
+#define _I2C_BUS_H_
+
+#ifdef ARDUINO
+#include "../grbl/hal.h"
+#else
+#include "grbl/hal.h"
+#endif
+
+#ifndef I2C_BUS_CLOCK
+#define I2C_BUS_CLOCK 100000    // Hz
+#endif
+
+#ifndef I2C_BUS_QUEUE_SIZE
+#ifdef LEDS2_I2CADDR
+#define I2C_BUS_QUEUE_SIZE 8    // transfers per class, must be a power of 2, room for a write per LED expander and an input read
+#else
+#define I2C_BUS_QUEUE_SIZE 4    // transfers per class, must be a power of 2
+#endif
+#endif
+
+#define I2C_BUS_INLINE_SIZE 4   // writes up to this length are copied and sent blocking, the caller buffer can be reused immediately
+
+#ifndef I2C_BUS_STATS_WINDOW
+#define I2C_BUS_STATS_WINDOW 1000   // ms, sliding window for bus utilisation, I2C_BUS_STATS_SLOTS steps
+#endif
+#define I2C_BUS_STATS_SLOTS 10
+
+// Priority classes, lowest value first. A transfer in progress is never interrupted,
+// the highest priority pending transfer is started when it completes.
+typedef enum {
+    I2CBus_Keypad = 0,  //!< keycode reads
+    I2CBus_Leds,        //!< LED updates
+    I2CBus_Display,     //!< display packets
+    I2CBus_Classes
+} i2c_bus_class_t;
+
+// Called from the foreground process when a transfer has completed or failed.
+typedef void (*i2c_bus_done_ptr)(bool ok, void *context);
+
+typedef struct {
+    uint32_t transfers;     // total
+    uint32_t bytes;         // total, data bytes
+    uint32_t failures;      // total, transfers not acknowledged
+    uint32_t dropped;       // total, queue full
+    uint64_t bus_time;      // us, total
+    uint32_t latency;       // us, last wait for the bus
+    uint32_t latency_avg;   // us, moving average
+    uint32_t latency_max;   // us
+    float utilisation;      // percent of bus time, last I2C_BUS_STATS_WINDOW ms
+    float utilisation_peak; // percent of bus time, highest over any I2C_BUS_STATS_WINDOW ms
+} i2c_bus_stats_t;
+
+// Bus time in microseconds for a transfer of len bytes: address + data, 9 clocks per byte plus start/stop.
+static inline uint32_t i2c_bus_time (size_t len)
+{
+    return (uint32_t)(((len + 1) * 9 + 2) * 1000000UL / I2C_BUS_CLOCK);
+}
+
+// Queues a write, data longer than I2C_BUS_INLINE_SIZE must be kept valid until done is called. done may be NULL.
+bool i2c_bus_send (i2c_bus_class_t class, uint_fast16_t address, uint8_t *data, size_t len, i2c_bus_done_ptr done, void *context);
+// Queues a read, data must be kept valid until done is called.
+bool i2c_bus_receive (i2c_bus_class_t class, uint_fast16_t address, uint8_t *data, size_t len, i2c_bus_done_ptr done, void *context);
+// Queues a write followed by a read of the reply, the bus is not released in between. data is handled as for
+// i2c_bus_send(), reply must be kept valid until done is called.
+bool i2c_bus_send_receive (i2c_bus_class_t class, uint_fast16_t address, uint8_t *data, size_t len, uint8_t *reply, size_t reply_len, i2c_bus_done_ptr done, void *context);
+// Queues a probe, done is called with ok set if the device answered.
+bool i2c_bus_probe (i2c_bus_class_t class, uint_fast16_t address, i2c_bus_done_ptr done, void *context);
+// Requests a keycode read in the I2CBus_Keypad class, may be called from an interrupt handler.
+// The read is queued by a foreground task. I2C keypad (KEYPAD_ENABLE == 1) builds only.
+bool i2c_bus_get_keycode (uint_fast16_t address, keycode_callback_ptr callback);
+// Blocking write and read bypassing the queue, for use during startup only. Counted in the class statistics.
+bool i2c_bus_send_blocking (i2c_bus_class_t class, uint_fast16_t address, uint8_t *data, size_t len);
+bool i2c_bus_receive_blocking (i2c_bus_class_t class, uint_fast16_t address, uint8_t *data, size_t len);
+// Returns the statistics for the class, I2CBus_Classes for the whole bus.
+const i2c_bus_stats_t *i2c_bus_get_stats (i2c_bus_class_t class);
+void i2c_bus_init (void);
+
+#endif
@@ -31,6 +31,9 @@
 #include <string.h>
 
 #include "keypad.h"
+#if KEYPAD_ENABLE == 1
+#include "i2c_bus.h"
+#endif
 
 #ifdef ARDUINO
 #include "../grbl/plugins.h"
@@ -48,13 +51,23 @@
 #include "grbl/state_machine.h"
 #endif
 
+// Keycodes from the keypad and from other sources, e.g. LED expander buttons added by keypad_keypress(),
+// have separate key held state. A jog is only cancelled when the key of the source that started it is released.
+typedef enum {
+    KeySource_Keypad = 0,
+    KeySource_Buttons,
+    KeySource_Count
+} key_source_t;
+
 typedef struct {
     char buf[KEYBUF_SIZE];
+    key_source_t source[KEYBUF_SIZE];
     volatile uint_fast8_t head;
     volatile uint_fast8_t tail;
 } keybuffer_t;
 
-static bool jogging = false, keyreleased = true;
+static volatile bool jogging = false, keyreleased[KeySource_Count] = { true, true };
+static volatile key_source_t jog_source = KeySource_Keypad;
 static jogmode_t jogMode = JogMode_Fast;
 static jog_settings_t jog;
 static jogdata_t jogdata = {
@@ -133,11 +146,12 @@ static setting_details_t setting_details = {
 };
 
 // Returns 0 if no keycode enqueued
-static char keypad_get_keycode (void)
+static char keypad_get_keycode (key_source_t *source)
 {
     uint32_t data = 0, bptr = keybuf.tail;
 
     if(bptr != keybuf.head) {
+        *source = keybuf.source[bptr];
         data = keybuf.buf[bptr++];               // Get next character, increment tmp pointer
         keybuf.tail = bptr & (KEYBUF_SIZE - 1);  // and update pointer
     }
@@ -169,7 +183,8 @@ static void jog_command (char *cmd, char *to)
 static void keypad_process_keypress (void *data)
 {
     bool addedGcode, jogCommand = false;
-    char command[35] = "", keycode = keypad_get_keycode();
+    key_source_t source = KeySource_Keypad;
+    char command[35] = "", keycode = keypad_get_keycode(&source);
     sys_state_t state = state_get();
 
     if(state & (STATE_ESTOP|STATE_ALARM) &&
@@ -401,9 +416,12 @@ static void keypad_process_keypress (void *data)
                 }
             }
 
-            if(!(jogCommand && keyreleased)) { // key still pressed? - do not execute jog command if released!
+            if(!(jogCommand && keyreleased[source])) { // key still pressed? - do not execute jog command if released!
                 addedGcode = grbl.enqueue_gcode((char *)command);
-                jogging = jogging || (jogCommand && addedGcode);
+                if(jogCommand && addedGcode) {
+                    jogging = true;
+                    jog_source = source;
+                }
             }
         }
     }
@@ -414,36 +432,52 @@ static void onReportOptions (bool newopt)
     on_report_options(newopt);
 
     if(!newopt)
-        hal.stream.write("[PLUGIN:KEYPAD v1.38]" ASCII_EOL);
+        hal.stream.write("[PLUGIN:KEYPAD v1.41]" ASCII_EOL);
 }
 
-#if KEYPAD_ENABLE == 1
-
-ISR_CODE static void ISR_FUNC(i2c_enqueue_keycode)(char c)
+ISR_CODE static bool ISR_FUNC(enqueue_keycode)(char c, key_source_t source)
 {
+    bool ok;
     uint32_t bptr = (keybuf.head + 1) & (KEYBUF_SIZE - 1);    // Get next head pointer
 
-    if(bptr != keybuf.tail) {           // If not buffer full
-        keybuf.buf[keybuf.head] = c;    // add data to buffer
-        keybuf.head = bptr;             // and update pointer
+    if((ok = bptr != keybuf.tail)) {            // If not buffer full
+        keybuf.buf[keybuf.head] = c;            // add data to buffer
+        keybuf.source[keybuf.head] = source;
+        keybuf.head = bptr;                     // and update pointer
         // Tell foreground process to process keycode
         if(nvs_address != 0)
             task_add_immediate(keypad_process_keypress, NULL);
     }
+
+    return ok;
 }
 
-ISR_CODE bool ISR_FUNC(keypad_strobe_handler)(uint_fast8_t id, bool keydown)
+// Cancels the jog in progress if started by a key from the source.
+ISR_CODE static void ISR_FUNC(key_released)(key_source_t source)
 {
-    keyreleased = !keydown;
-
-    if(keydown)
-        i2c_get_keycode(KEYPAD_I2CADDR, i2c_enqueue_keycode);
+    keyreleased[source] = true;
 
-    else if(jogging) {
+    if(jogging && jog_source == source) {
         jogging = false;
         grbl.enqueue_realtime_command(CMD_JOG_CANCEL);
         keybuf.tail = keybuf.head; // flush keycode buffer
     }
+}
+
+#if KEYPAD_ENABLE == 1
+
+ISR_CODE static void ISR_FUNC(i2c_enqueue_keycode)(char c)
+{
+    enqueue_keycode(c, KeySource_Keypad);
+}
+
+ISR_CODE bool ISR_FUNC(keypad_strobe_handler)(uint_fast8_t id, bool keydown)
+{
+    if(keydown) {
+        keyreleased[KeySource_Keypad] = false;
+        i2c_bus_get_keycode(KEYPAD_I2CADDR, i2c_enqueue_keycode);
+    } else
+        key_released(KeySource_Keypad);
 
     return true;
 }
@@ -457,6 +491,8 @@ bool keypad_init (void)
 
         settings_register(&setting_details);
 
+        i2c_bus_init();
+
         if(keypad.on_jogmode_changed)
             keypad.on_jogmode_changed(jogMode);
     }
@@ -468,28 +504,16 @@ bool keypad_init (void)
 
 static ISR_CODE bool ISR_FUNC(keypad_enqueue_keycode)(char c)
 {
-    uint32_t bptr = (keybuf.head + 1) & (KEYBUF_SIZE - 1);    // Get next head pointer
-
 #if MPG_ENABLE && defined(MPG_STREAM) && MPG_STREAM != KEYPAD_STREAM
     if(c == CMD_MPG_MODE_TOGGLE)
         return true;
 #endif
 
     if(c == CMD_JOG_CANCEL || (c == ASCII_CAN && !(state_get() & (STATE_ESTOP|STATE_ALARM)))) {
-        keyreleased = true;
-        if(jogging) {
-            jogging = false;
-            grbl.enqueue_realtime_command(CMD_JOG_CANCEL);
-        }
+        key_released(KeySource_Keypad);
         keybuf.tail = keybuf.head;      // Flush keycode buffer.
-    } else if(bptr != keybuf.tail) {    // If not buffer full
-        keybuf.buf[keybuf.head] = c;    // add data to buffer
-        keybuf.head = bptr;             // and update pointer.
-        keyreleased = false;
-        // Tell foreground process to process keycode
-        if(nvs_address != 0)
-            task_add_immediate(keypad_process_keypress, NULL);
-    }
+    } else if(enqueue_keycode(c, KeySource_Keypad))
+        keyreleased[KeySource_Keypad] = false;
 
     return true;
 }
@@ -499,9 +523,9 @@ bool keypad_init (void)
     if((nvs_address = nvs_alloc(sizeof(jog_settings_t)))) {
 
 #if MPG_ENABLE && defined(MPG_STREAM) && MPG_STREAM == KEYPAD_STREAM
-        if((hal.driver_cap.mpg_mode = stream_mpg_register(stream_open_instance(KEYPAD_STREAM, 115200, NULL, "MPG & Keypad"), false, keypad_enqueue_keycode))) {
+        if((hal.driver_cap.mpg_mode = stream_mpg_register((keypad.stream = stream_open_instance(KEYPAD_STREAM, 115200, NULL, "MPG & Keypad")), false, keypad_enqueue_keycode))) {
 #else
-        if(stream_open_instance(KEYPAD_STREAM, 115200, keypad_enqueue_keycode, "Keypad")) {
+        if((keypad.stream = stream_open_instance(KEYPAD_STREAM, 115200, keypad_enqueue_keycode, "Keypad"))) {
 #endif
             on_report_options = grbl.on_report_options;
             grbl.on_report_options = onReportOptions;
@@ -518,4 +542,15 @@ bool keypad_init (void)
 
 #endif // KEYPAD_ENABLE == 2
 
+// Adds a keycode from another input source such as buttons on the LED expander, may be called from an interrupt handler.
+// A jog started by the key is cancelled when it is released, key held state is kept apart from the keypad.
+ISR_CODE void ISR_FUNC(keypad_keypress)(char c, bool keydown)
+{
+    if(keydown) {
+        keyreleased[KeySource_Buttons] = false;
+        enqueue_keycode(c, KeySource_Buttons);
+    } else
+        key_released(KeySource_Buttons);
+}
+
 #endif // KEYPAD_ENABLE
@@ -25,9 +25,11 @@
 #ifdef ARDUINO
 #include "../grbl/gcode.h"
 #include "../grbl/settings.h"
+#include "../grbl/stream.h"
 #else
 #include "grbl/gcode.h"
 #include "grbl/settings.h"
+#include "grbl/stream.h"
 #endif
 
 #define KEYBUF_SIZE 8 // must be a power of 2
@@ -75,8 +77,11 @@ typedef struct {
     on_keypress_preview_ptr on_keypress_preview;
     on_jogmode_changed_ptr on_jogmode_changed;
     on_jogdata_changed_ptr on_jogdata_changed;
+    const io_stream_t *stream;  //!< KEYPAD_ENABLE == 2 only, the keypad stream, may be shared by the display
 } keypad_t;
 
 extern keypad_t keypad;
 
+void keypad_keypress (char c, bool keydown);
+
 #endif // _KEYPAD_H_
@@ -0,0 +1,585 @@
+/*
+  display_sim.c - runs the I2C display plugin against a simulated core and decodes what it sends
+
+  Part of grblHAL keypad plugins
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <ctype.h>
+
+#include "mock_core.h"
+#include "display/i2c_interface.h"
+#include "display/protocol.h"
+#include "i2c_bus.h"
+
+void display_init (void);
+
+// Script commands, one per line:
+//   idle <ms>                  stay idle
+//   move <ms> <x> <y> <z>      linear move to machine position in Cycle state
+//   jog <ms> <x> <y> <z>       linear move to machine position in Jog state
+//   msg <text>                 G-code message
+//   alarm <code>               enter alarm state, cleared by the next motion command
+//   wco <x> <y> <z>            set work coordinate offsets
+//   spindle <rpm>              start spindle, 0 to stop
+//   unplug <n>, plug <n>       disconnect and reconnect display n
+static const char *default_script =
+    "idle 1000\n"
+    "wco 10 20 -5\n"
+    "jog 2000 10 0 0\n"
+    "idle 500\n"
+    "spindle 12000\n"
+    "msg Tool change pending, insert 6 mm end mill\n"
+    "move 4000 100 50 -2\n"
+    "move 3000 100 50 -10\n"
+    "move 1000 101 50 -10\n"
+    "spindle 0\n"
+    "idle 3000\n"
+    "alarm 1\n"
+    "idle 2000\n";
+
+typedef struct {
+    // display emulation
+    bool absent;                    // does not answer to its address
+    bool legacy;                    // do not answer the capabilities request
+    bool caps_requested;
+    display_caps_t caps;
+    uint8_t last_seq;
+    // decoded state
+    machine_status_packet_t v1;
+    machine_status_t v2;
+    float displayed[N_AXIS];        // coordinates shown, work position
+    bool has_position;
+    uint64_t position_us;           // time of last coordinate update
+    // results
+    uint32_t packets;
+    uint32_t bytes;
+    uint32_t malformed;
+    uint32_t state_mismatches;
+    uint64_t bus_us;
+    uint64_t last_packet_us;
+    uint64_t max_interval_us;
+    uint64_t moving_ms;
+    uint64_t staleness_sum_ms;
+    uint64_t staleness_max_ms;
+    double error_sum;
+    float error_max;
+} display_t;
+
+#ifndef DISPLAY_I2CADDRS
+#define DISPLAY_I2CADDRS { 0x49 }
+#endif
+
+#ifdef DISPLAY_STREAM
+static const uint8_t addresses[] = { 0 };   // single display on the stream
+#define transfer_time(len) (DISPLAY_COBS_SIZE(len) * 10000000ULL / 115200) // default stream baud rate
+#else
+static const uint8_t addresses[] = DISPLAY_I2CADDRS;
+#define transfer_time(len) i2c_bus_time(len)
+#endif
+
+#define N_DISPLAYS (sizeof(addresses) / sizeof(uint8_t))
+
+static display_t displays[N_DISPLAYS] = {0};
+static bool verbose = false;
+static float position[N_AXIS] = {0};    // machine position
+
+static machine_state_t expected_state (void)
+{
+    switch(sim.state) {
+        case STATE_ALARM:
+            return MachineState_Alarm;
+        case STATE_CYCLE:
+            return MachineState_Cycle;
+        case STATE_JOG:
+            return MachineState_Jog;
+        case STATE_HOLD:
+            return MachineState_Hold;
+        case STATE_IDLE:
+            return MachineState_Idle;
+        default:
+            return MachineState_Other;
+    }
+}
+
+static display_t *get_display (uint_fast16_t address)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < N_DISPLAYS; idx++) {
+        if(addresses[idx] == address)
+            return &displays[idx];
+    }
+
+    return NULL;
+}
+
+static void print_packet (uint_fast16_t address, const uint8_t *data, size_t len, const char *result)
+{
+    size_t idx;
+
+    printf("%8.3f %02X %3zu:", (double)sim.us / 1e6, (unsigned)address, len);
+    for(idx = 0; idx < len && idx < 24; idx++)
+        printf(" %02X", data[idx]);
+    printf("%s %s\n", len > 24 ? " ..." : "", result);
+}
+
+// Returns false if malformed.
+static bool decode_v1 (display_t *d, const uint8_t *data, size_t len, bool *state_ok)
+{
+    size_t expected = offsetof(machine_status_packet_t, msgtype);
+
+    if(len > expected) {
+        msg_type_t msgtype = data[expected];
+        expected = offsetof(machine_status_packet_t, msg);
+        if(msgtype > 0 && msgtype < 128)
+            expected += msgtype;
+        else if(msgtype == MachineMsg_Overrides)
+            expected += sizeof(overrides_t);
+        else if(msgtype == MachineMsg_WorkOffset)
+            expected += sizeof(machine_coords_t);
+    }
+
+    if(len != expected)
+        return false;
+
+    memcpy(&d->v1, data, len);
+    memcpy(d->displayed, d->v1.coordinate.values, sizeof(float) * min(4, N_AXIS));
+    d->has_position = true;
+    d->position_us = sim.us;
+    *state_ok = d->v1.machine_state == expected_state();
+
+    return true;
+}
+
+// Returns false if malformed or corrupted.
+static bool decode_v2 (display_t *d, const uint8_t *data, size_t len, bool *state_ok)
+{
+    uint_fast8_t idx;
+    status_fields_t fields;
+
+    if((*data & PACKET_CHECKED) && !display_check_trailer(data, len, &d->last_seq))
+        return false;
+
+    if(!display_decode_status(data, len, &d->v2, &fields))
+        return false;
+
+    for(idx = 0; idx < N_AXIS; idx++) {
+        if(fields & (1UL << STATUS_V2_COORDINATE_FIELD(idx))) {
+            d->displayed[idx] = d->v2.coordinate.values[idx];
+            d->has_position = true;
+            d->position_us = sim.us;
+        }
+    }
+
+    if(verbose && (fields & (1UL << StatusField_Message)) && d->v2.msgtype > 0 && d->v2.msgtype < 128)
+        printf("         message: %.*s\n", d->v2.msgtype, d->v2.msg);
+
+    if(verbose && (fields & (1UL << StatusField_Message)) && d->v2.msgtype == MachineMsg_Alarm)
+        printf("         alarm: %u\n", d->v2.msg[0]);
+
+    if(verbose && (fields & (1UL << StatusField_SpindleRPM)))
+        printf("         spindle: %d RPM\n", (int)d->v2.spindle_rpm);
+
+    *state_ok = !(fields & (1UL << StatusField_MachineState)) || d->v2.machine_state == expected_state();
+
+    return true;
+}
+
+static bool display_probe (uint_fast16_t address)
+{
+    display_t *d = get_display(address);
+
+    return d && !d->absent;
+}
+
+static bool display_write (uint_fast16_t address, const uint8_t *data, size_t len)
+{
+    bool ok = true, state_ok = true;
+    display_t *d = get_display(address);
+
+    if(d == NULL || d->absent)
+        return false;
+
+    if(len == 1 && *data == PacketType_Caps) {
+        d->caps_requested = !d->legacy;
+        return true;
+    }
+
+    // The display discards packets longer than it advertised.
+    if(d->caps.max_packet_size && len > d->caps.max_packet_size)
+        ok = false;
+    else if(len && *data == PacketType_Status)
+        ok = decode_v1(d, data, len, &state_ok);
+    else if(len && (*data & ~PACKET_CHECKED) == PacketType_Delta)
+        ok = decode_v2(d, data, len, &state_ok);
+    else
+        ok = false;
+
+    if(!ok)
+        d->malformed++;
+    else if(!state_ok)
+        d->state_mismatches++;
+
+    if(d->last_packet_us && sim.us - d->last_packet_us > d->max_interval_us)
+        d->max_interval_us = sim.us - d->last_packet_us;
+
+    d->packets++;
+    d->bytes += len;
+    d->bus_us += transfer_time(len);
+    d->last_packet_us = sim.us;
+
+    if(verbose)
+        print_packet(address, data, len, !ok ? "MALFORMED" : (state_ok ? "" : "state mismatch"));
+
+    return true;
+}
+
+static bool display_read (uint_fast16_t address, uint8_t *data, size_t len)
+{
+    display_t *d = get_display(address);
+
+    if(d == NULL || d->absent)
+        return false;
+
+    if(d->caps_requested) {
+        d->caps_requested = false;
+        return display_encode_caps(data, &d->caps) <= len;
+    }
+
+    if(d->caps.flags.ack && len >= DISPLAY_ACK_SIZE) {
+        data[0] = DISPLAY_ACK_MAGIC;
+        data[1] = d->last_seq;
+        return true;
+    }
+
+    return false;
+}
+
+#ifdef DISPLAY_STREAM
+
+// Collects stream output into frames, decoded frames are handled as packets written to the display.
+static void display_stream_write (const uint8_t *data, size_t len)
+{
+    static uint8_t frame[DISPLAY_COBS_SIZE(STATUS_V2_PACKET_SIZE_MAX)];
+    static size_t frame_len = 0;
+
+    uint8_t packet[sizeof(frame)];
+    size_t packet_len;
+
+    while(len--) {
+        if(*data == 0) {
+            if(frame_len && (packet_len = display_cobs_decode(packet, frame, frame_len)))
+                display_write(addresses[0], packet, packet_len);
+            else
+                displays[0].malformed++;
+            frame_len = 0;
+        } else if(frame_len < sizeof(frame))
+            frame[frame_len++] = *data;
+        data++;
+    }
+}
+
+#endif
+
+// Samples displayed vs. actual work position every ms while moving.
+// Staleness is the time since the displayed position was last updated or current.
+static void sample (display_t *d)
+{
+    uint_fast8_t idx;
+    float error = 0.0f;
+
+    if(!d->has_position)
+        return;
+
+    for(idx = 0; idx < min(4, N_AXIS); idx++)
+        error = max(error, fabsf(position[idx] - sim.wco[idx] - d->displayed[idx]));
+
+    if(error < 0.001f)
+        d->position_us = sim.us;
+
+    if(sim.feed_rate <= 0.0f)
+        return;
+
+    uint64_t staleness = (sim.us - d->position_us) / 1000;
+
+    d->moving_ms++;
+    d->staleness_sum_ms += staleness;
+    d->staleness_max_ms = max(d->staleness_max_ms, staleness);
+    d->error_sum += error;
+    d->error_max = max(d->error_max, error);
+}
+
+static void step_ms (void)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < N_AXIS; idx++)
+        sys.position[idx] = (int32_t)lroundf(position[idx] * SIM_STEPS_PER_MM);
+
+    sim_run_tasks();
+    for(idx = 0; idx < N_DISPLAYS; idx++)
+        sample(&displays[idx]);
+    sim_advance(1000);
+}
+
+static void run_idle (uint32_t ms)
+{
+    sim.feed_rate = 0.0f;
+
+    while(ms--)
+        step_ms();
+}
+
+static void run_move (uint32_t ms, const float *target, sys_state_t state)
+{
+    uint_fast8_t idx;
+    uint32_t t;
+    float start[N_AXIS], distance = 0.0f;
+
+    if(ms == 0)
+        ms = 1;
+
+    memcpy(start, position, sizeof(start));
+    for(idx = 0; idx < min(3, N_AXIS); idx++)
+        distance += (target[idx] - start[idx]) * (target[idx] - start[idx]);
+
+    sim.feed_rate = sqrtf(distance) * 60000.0f / (float)ms;
+    sim_set_state(state, 0);
+
+    for(t = 1; t <= ms; t++) {
+        for(idx = 0; idx < min(3, N_AXIS); idx++)
+            position[idx] = start[idx] + (target[idx] - start[idx]) * (float)t / (float)ms;
+        step_ms();
+    }
+
+    sim.feed_rate = 0.0f;
+    sim_set_state(STATE_IDLE, 0);
+}
+
+static bool run_script (const char *script)
+{
+    char line[160], cmd[16];
+    const char *s = script, *eol;
+    float v[3] = {0};
+    uint32_t ms;
+    int lineno = 0;
+
+    while(*s) {
+
+        eol = strchr(s, '\n');
+        size_t len = eol ? (size_t)(eol - s) : strlen(s);
+        if(len >= sizeof(line))
+            len = sizeof(line) - 1;
+        memcpy(line, s, len);
+        line[len] = '\0';
+        s = eol ? eol + 1 : s + strlen(s);
+        lineno++;
+
+        if(*line == '#' || sscanf(line, "%15s", cmd) != 1)
+            continue;
+
+        if(!strcmp(cmd, "idle") && sscanf(line, "%*s %u", &ms) == 1)
+            run_idle(ms);
+        else if((!strcmp(cmd, "move") || !strcmp(cmd, "jog")) && sscanf(line, "%*s %u %f %f %f", &ms, &v[0], &v[1], &v[2]) == 4)
+            run_move(ms, v, *cmd == 'j' ? STATE_JOG : STATE_CYCLE);
+        else if(!strcmp(cmd, "msg")) {
+            char *msg = line + 3;
+            while(isspace((unsigned char)*msg))
+                msg++;
+            if(grbl.on_gcode_message)
+                grbl.on_gcode_message(msg);
+        } else if(!strcmp(cmd, "alarm") && sscanf(line, "%*s %u", &ms) == 1)
+            sim_set_state(STATE_ALARM, (uint8_t)ms);
+        else if((!strcmp(cmd, "plug") || !strcmp(cmd, "unplug")) && sscanf(line, "%*s %u", &ms) == 1 && ms < N_DISPLAYS)
+            displays[ms].absent = *cmd == 'u';
+        else if(!strcmp(cmd, "spindle") && sscanf(line, "%*s %f", &v[0]) == 1)
+            sim_set_spindle(v[0]);
+        else if(!strcmp(cmd, "wco") && sscanf(line, "%*s %f %f %f", &v[0], &v[1], &v[2]) == 3) {
+            memcpy(sim.wco, v, sizeof(float) * min(3, N_AXIS));
+            if(grbl.on_wco_changed)
+                grbl.on_wco_changed();
+        } else {
+            fprintf(stderr, "line %d: invalid command: %s\n", lineno, line);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static char *load_file (const char *name)
+{
+    FILE *f;
+    long size;
+    char *buf = NULL;
+
+    if((f = fopen(name, "rb"))) {
+        fseek(f, 0, SEEK_END);
+        size = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        if((buf = malloc(size + 1)) && fread(buf, 1, size, f) == (size_t)size)
+            buf[size] = '\0';
+        fclose(f);
+    }
+
+    return buf;
+}
+
+static void usage (const char *name)
+{
+    fprintf(stderr, "Usage: %s [options] [script]\n"
+                    "  -d n      following options apply to display n only, by default to all\n"
+                    "  -x        display not connected\n"
+                    "  -l        legacy display, do not answer the capabilities request\n"
+                    "  -c        display accepts checked (CRC) packets\n"
+                    "  -a        display acknowledges checked packets\n"
+                    "  -k        display has alarm texts, alarms are sent as codes\n"
+                    "  -m bytes  display max packet size, ignored unless a protocol v2 I2C build\n"
+                    "  -i ms     display preferred update interval\n"
+                    "  -f mask   status fields used by the display (hex), default all\n"
+                    "  -v        print each packet\n", name);
+}
+
+int main (int argc, char **argv)
+{
+    int opt, result = 0;
+    char *script = (char *)default_script;
+    uint_fast8_t idx, first = 0, last = N_DISPLAYS - 1;
+    double seconds;
+    display_t *d;
+
+    for(idx = 0; idx < N_DISPLAYS; idx++) {
+        displays[idx].caps.version = DISPLAY_PROTOCOL;
+        displays[idx].caps.fields = (1UL << StatusField_Count) - 1;
+    }
+
+    while((opt = getopt(argc, argv, "d:xlcakm:i:f:vh")) != -1) {
+
+        if(opt == 'd') {
+            if((unsigned)atoi(optarg) >= N_DISPLAYS) {
+                fprintf(stderr, "display %s not configured, %u display(s)\n", optarg, (unsigned)N_DISPLAYS);
+                return 2;
+            }
+            first = last = (uint_fast8_t)atoi(optarg);
+            continue;
+        }
+
+        if(opt == 'v') {
+            verbose = true;
+            continue;
+        }
+
+        for(idx = first; idx <= last; idx++) switch(opt) {
+
+            case 'x':
+                displays[idx].absent = true;
+                break;
+
+            case 'l':
+                displays[idx].legacy = true;
+                break;
+
+            case 'c':
+                displays[idx].caps.flags.crc = On;
+                break;
+
+            case 'a':
+                displays[idx].caps.flags.crc = displays[idx].caps.flags.ack = On;
+                break;
+
+            case 'k':
+                displays[idx].caps.flags.codes = On;
+                break;
+
+            case 'm':
+#if DISPLAY_PROTOCOL == 2 && !defined(DISPLAY_STREAM)
+                displays[idx].caps.max_packet_size = (uint8_t)atoi(optarg);
+#else
+                // The size is advertised in the capabilities reply, there is none in this build.
+                fprintf(stderr, "-m ignored, protocol v2 I2C builds only\n");
+#endif
+                break;
+
+            case 'i':
+                displays[idx].caps.update_interval = (uint16_t)atoi(optarg);
+                break;
+
+            case 'f':
+                displays[idx].caps.fields = (status_fields_t)strtoul(optarg, NULL, 16);
+                break;
+
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if(optind < argc && !(script = load_file(argv[optind]))) {
+        fprintf(stderr, "cannot read %s\n", argv[optind]);
+        return 2;
+    }
+
+    sim.i2c_write = display_write;
+    sim.i2c_read = display_read;
+    sim.i2c_probe = display_probe;
+#ifdef DISPLAY_STREAM
+    sim.stream_write = display_stream_write;
+    sim.connected = !displays[0].absent;
+#endif
+
+    display_init();
+
+    // The core inits the report handlers after the plugins at boot, before any display answers its probe.
+    if(grbl.on_report_handlers_init)
+        grbl.on_report_handlers_init();
+
+    if(!run_script(script))
+        return 2;
+
+    seconds = (double)sim.us / 1e6;
+
+    printf("protocol %d build, %d axes, %.1f s simulated, foreground tasks run %u, spindle RPM reads %u\n", DISPLAY_PROTOCOL, N_AXIS, seconds, sim.task_runs, sim.rpm_reads);
+
+    for(idx = 0; idx < N_DISPLAYS; idx++) {
+        d = &displays[idx];
+        if(N_DISPLAYS > 1)
+            printf("display %u at %02X%s\n", idx, addresses[idx], d->absent ? ", not connected" : "");
+        if(d->absent)
+            continue;
+        printf("packets %u (%.1f/s), bytes %u (%.1f/s, %.1f/packet), bus %.2f%%\n",
+                d->packets, d->packets / seconds, d->bytes, d->bytes / seconds,
+                d->packets ? (double)d->bytes / d->packets : 0.0, d->bus_us / seconds / 1e4);
+        printf("longest interval %.0f ms\n", d->max_interval_us / 1e3);
+        if(d->moving_ms)
+            printf("while moving: staleness avg %.1f ms max %u ms, position error avg %.3f mm max %.3f mm\n",
+                    (double)d->staleness_sum_ms / d->moving_ms, (unsigned)d->staleness_max_ms,
+                    d->error_sum / d->moving_ms, d->error_max);
+        printf("malformed %u, state mismatches %u\n", d->malformed, d->state_mismatches);
+        if(d->malformed)
+            result = 1;
+    }
+
+    sim_execute_command("DISPLAY");
+    sim_execute_command("I2C");
+#ifdef DISPLAY_TELEMETRY_INTERVAL
+    sim_execute_command("TELEMETRY=10");
+#endif
+
+    return result;
+}
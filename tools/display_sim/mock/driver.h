@@ -0,0 +1,27 @@
+/*
+  driver.h - mock grblHAL driver configuration for the display simulator
+*/
+
+#pragma once
+
+#ifndef N_AXIS
+#define N_AXIS 3
+#endif
+
+#ifndef DISPLAY_ENABLE
+#define DISPLAY_ENABLE 1
+#endif
+
+#ifndef KEYPAD_ENABLE
+#define KEYPAD_ENABLE 0
+#endif
+
+#ifndef I2C_ENABLE
+#define I2C_ENABLE 1
+#endif
+
+#ifndef KEYPAD_STREAM
+#define KEYPAD_STREAM 1
+#endif
+
+#include "grbl/hal.h"
@@ -0,0 +1,655 @@
+/*
+  grbl/hal.h - minimal mock of the grblHAL core API used by the keypad plugins
+
+  Only the types, globals and functions referenced by the plugin sources are
+  declared here, layouts follow the core where the wire format depends on them.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+#ifndef N_AXIS
+#define N_AXIS 3
+#endif
+
+#define AXES_BITMASK ((1 << N_AXIS) - 1)
+
+#define ASCII_LF  '\n'
+#define ASCII_CAN 0x18
+#define ASCII_EOL "\r\n"
+#define SERIAL_NO_DATA -1
+
+#define ISR_CODE
+#define ISR_FUNC(f) f
+
+#define On  1
+#define Off 0
+
+#ifndef min
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+#define bit(n) (1UL << (n))
+
+#define CMD_STATUS_REPORT_LEGACY '?'
+#define CMD_CYCLE_START_LEGACY '~'
+#define CMD_FEED_HOLD_LEGACY '!'
+#define CMD_RESET 0x18
+#define CMD_STATUS_REPORT 0x80
+#define CMD_CYCLE_START 0x81
+#define CMD_FEED_HOLD 0x82
+#define CMD_SAFETY_DOOR 0x84
+#define CMD_JOG_CANCEL 0x85
+#define CMD_OPTIONAL_STOP_TOGGLE 0x88
+#define CMD_SINGLE_BLOCK_TOGGLE 0x89
+#define CMD_OVERRIDE_FAN0_TOGGLE 0x8A
+#define CMD_MPG_MODE_TOGGLE 0x8B
+#define CMD_OVERRIDE_FEED_RESET 0x90
+#define CMD_OVERRIDE_FEED_COARSE_PLUS 0x91
+#define CMD_OVERRIDE_FEED_COARSE_MINUS 0x92
+#define CMD_OVERRIDE_FEED_FINE_PLUS 0x93
+#define CMD_OVERRIDE_FEED_FINE_MINUS 0x94
+#define CMD_OVERRIDE_RAPID_RESET 0x95
+#define CMD_OVERRIDE_RAPID_MEDIUM 0x96
+#define CMD_OVERRIDE_RAPID_LOW 0x97
+#define CMD_OVERRIDE_SPINDLE_RESET 0x99
+#define CMD_OVERRIDE_SPINDLE_COARSE_PLUS 0x9A
+#define CMD_OVERRIDE_SPINDLE_COARSE_MINUS 0x9B
+#define CMD_OVERRIDE_SPINDLE_FINE_PLUS 0x9C
+#define CMD_OVERRIDE_SPINDLE_FINE_MINUS 0x9D
+#define CMD_OVERRIDE_SPINDLE_STOP 0x9E
+#define CMD_OVERRIDE_COOLANT_FLOOD_TOGGLE 0xA0
+#define CMD_OVERRIDE_COOLANT_MIST_TOGGLE 0xA1
+#define CMD_PROBE_CONNECTED_TOGGLE 0xA4
+
+typedef uint_fast16_t sys_state_t;
+
+#define STATE_IDLE          0
+#define STATE_ALARM         bit(0)
+#define STATE_CHECK_MODE    bit(1)
+#define STATE_HOMING        bit(2)
+#define STATE_CYCLE         bit(3)
+#define STATE_HOLD          bit(4)
+#define STATE_JOG           bit(5)
+#define STATE_SAFETY_DOOR   bit(6)
+#define STATE_SLEEP         bit(7)
+#define STATE_ESTOP         bit(8)
+#define STATE_TOOL_CHANGE   bit(9)
+
+typedef enum {
+    Status_OK = 0,
+    Status_ExpectedCommandLetter = 1,
+    Status_BadNumberFormat = 2,
+    Status_InvalidStatement = 3,
+    Status_SettingValueOutOfRange = 33,
+    Status_Unhandled = 84
+} __attribute__((__packed__)) status_code_t;
+
+typedef enum {
+    CoordinateSystem_G54 = 0,
+    CoordinateSystem_G59_3 = 8
+} __attribute__((__packed__)) coord_system_id_t;
+
+typedef uint8_t alarm_code_t;
+typedef uint8_t message_code_t;
+
+typedef union {
+    uint8_t mask;
+    uint8_t value;
+    struct {
+        uint8_t x :1,
+                y :1,
+                z :1,
+                a :1,
+                b :1,
+                c :1,
+                u :1,
+                v :1;
+    };
+} axes_signals_t;
+
+typedef union {
+    uint8_t value;
+    uint8_t mask;
+    struct {
+        uint8_t on       :1,
+                ccw      :1,
+                pwm      :1,
+                reserved :4,
+                at_speed :1;
+    };
+} spindle_state_t;
+
+typedef union {
+    uint8_t value;
+    uint8_t mask;
+    struct {
+        uint8_t flood  :1,
+                mist   :1,
+                unused :6;
+    };
+} coolant_state_t;
+
+typedef union {
+    uint16_t value;
+    uint16_t mask;
+    struct {
+        uint16_t reset              :1,
+                 feed_hold          :1,
+                 cycle_start        :1,
+                 safety_door_ajar   :1,
+                 block_delete       :1,
+                 stop_disable       :1,
+                 e_stop             :1,
+                 probe_disconnected :1,
+                 unassigned         :8;
+    };
+} control_signals_t;
+
+typedef union {
+    uint8_t value;
+    struct {
+        uint8_t enabled       :1,
+                initiate      :1,
+                restore       :1,
+                unassigned    :5;
+    };
+} spindle_stop_t;
+
+typedef struct {
+    uint16_t feed_rate;
+    uint8_t rapid_rate;
+    uint8_t spindle_rpm;
+    spindle_stop_t spindle_stop;
+    coolant_state_t coolant;
+} overrides_t;
+
+typedef union {
+    uint32_t value;
+    struct {
+        uint32_t mpg_mode      :1,
+                 homed         :1,
+                 xmode         :1,
+                 spindle       :1,
+                 coolant       :1,
+                 overrides     :1,
+                 tool          :1,
+                 wco           :1,
+                 gwco          :1,
+                 tool_offset   :1,
+                 pwm           :1,
+                 motor         :1,
+                 encoder       :1,
+                 tlo_reference :1,
+                 fan           :1,
+                 unassigned    :17;
+    };
+} report_tracking_flags_t;
+
+typedef struct {
+    float step_speed;
+    float slow_speed;
+    float fast_speed;
+    float step_distance;
+    float slow_distance;
+    float fast_distance;
+} jog_settings_t;
+
+// Spindle
+
+typedef enum {
+    SpindleData_Counters,
+    SpindleData_RPM,
+    SpindleData_AngularPosition
+} spindle_data_request_t;
+
+typedef struct {
+    float rpm;
+    float angular_position;
+} spindle_data_t;
+
+typedef struct {
+    float rpm;
+    float rpm_overridden;
+    uint16_t override_pct;
+    spindle_state_t state;
+} spindle_param_t;
+
+typedef union {
+    uint16_t value;
+    struct {
+        uint16_t variable   :1,
+                 at_speed   :1,
+                 direction  :1,
+                 laser      :1,
+                 unassigned :12;
+    };
+} spindle_cap_t;
+
+typedef struct spindle_ptrs spindle_ptrs_t;
+
+typedef void (*spindle_set_state_ptr)(spindle_ptrs_t *spindle, spindle_state_t state, float rpm);
+typedef spindle_state_t (*spindle_get_state_ptr)(spindle_ptrs_t *spindle);
+typedef spindle_data_t *(*spindle_get_data_ptr)(spindle_data_request_t request);
+
+struct spindle_ptrs {
+    uint8_t id;
+    spindle_param_t *param;
+    spindle_cap_t cap;
+    spindle_set_state_ptr set_state;
+    spindle_get_state_ptr get_state;
+    spindle_get_data_ptr get_data;
+};
+
+// Streams
+
+typedef enum {
+    StreamType_Serial = 0,
+    StreamType_MPG
+} stream_type_t;
+
+typedef bool (*stream_write_char_ptr)(char c);
+typedef void (*stream_write_ptr)(const char *s);
+typedef void (*stream_write_n_ptr)(const uint8_t *s, uint16_t len);
+typedef int16_t (*stream_read_ptr)(void);
+typedef uint16_t (*get_stream_buffer_count_ptr)(void);
+
+typedef struct {
+    stream_type_t type;
+    uint8_t instance;
+    stream_write_ptr write;
+    stream_write_n_ptr write_n;
+    stream_write_char_ptr write_char;
+    stream_read_ptr read;
+    get_stream_buffer_count_ptr get_tx_buffer_count;
+    get_stream_buffer_count_ptr get_tx_buffer_size;
+    void *file;
+} io_stream_t;
+
+const io_stream_t *stream_open_instance (uint8_t instance, uint32_t baud_rate, stream_write_char_ptr rx_handler, const char *description);
+bool stream_mpg_register (const io_stream_t *stream, bool rx_only, stream_write_char_ptr write_char);
+bool stream_mpg_enable (bool on);
+
+// Foreground tasks
+
+typedef void (*foreground_task_ptr)(void *data);
+
+bool task_add_immediate (foreground_task_ptr fn, void *data);
+bool task_add_delayed (foreground_task_ptr fn, void *data, uint32_t delay_ms);
+bool task_add_periodic (foreground_task_ptr fn, void *data, uint32_t interval_ms);
+void task_delete (foreground_task_ptr fn, void *data);
+bool protocol_enqueue_foreground_task (foreground_task_ptr fn, void *data);
+
+// NVS
+
+typedef uint32_t nvs_address_t;
+
+typedef enum {
+    NVS_TransferResult_Failed = 0,
+    NVS_TransferResult_Busy,
+    NVS_TransferResult_OK
+} nvs_transfer_result_t;
+
+nvs_address_t nvs_alloc (size_t size);
+
+// Settings
+
+typedef uint16_t setting_id_t;
+typedef uint8_t setting_group_t;
+
+#define Setting_JogStepSpeed 50
+#define Setting_JogSlowSpeed 51
+#define Setting_JogFastSpeed 52
+#define Setting_JogStepDistance 53
+#define Setting_JogSlowDistance 54
+#define Setting_JogFastDistance 55
+#define Setting_UserDefined_0 450
+#define Setting_UserDefined_1 451
+#define Setting_UserDefined_2 452
+#define Setting_UserDefined_3 453
+#define Setting_UserDefined_4 454
+#define Setting_UserDefined_5 455
+#define Setting_UserDefined_6 456
+#define Setting_UserDefined_7 457
+#define Setting_UserDefined_8 458
+#define Setting_UserDefined_9 459
+#define Setting_MacroBase 490
+#define Setting_MacroPortBase 500
+#define Setting_ButtonActionBase 590
+
+#define Group_Root 0
+#define Group_General 1
+#define Group_Jogging 10
+#define Group_AuxPorts 20
+#define Group_UserSettings 30
+
+typedef enum {
+    Format_Bool = 0,
+    Format_Bitfield,
+    Format_XBitfield,
+    Format_RadioButtons,
+    Format_AxisMask,
+    Format_Integer,
+    Format_Decimal,
+    Format_String,
+    Format_Password,
+    Format_IPv4,
+    Format_Int8,
+    Format_Int16
+} setting_datatype_t;
+
+typedef enum {
+    Setting_NonCore = 0,
+    Setting_NonCoreFn,
+    Setting_IsExtended,
+    Setting_IsExtendedFn
+} setting_type_t;
+
+typedef struct {
+    uint8_t reboot_required :1,
+            allow_null      :1,
+            subgroups       :1,
+            increment       :4;
+} setting_flags_t;
+
+typedef struct setting_detail setting_detail_t;
+
+typedef bool (*setting_output_ptr)(const setting_detail_t *setting, uint_fast16_t offset, void *data);
+typedef bool (*setting_is_available_ptr)(const setting_detail_t *setting, uint_fast16_t offset);
+
+struct setting_detail {
+    setting_id_t id;
+    setting_group_t group;
+    const char *name;
+    const char *unit;
+    setting_datatype_t datatype;
+    const char *format;
+    const char *min_value;
+    const char *max_value;
+    setting_type_t type;
+    void *value;
+    void *get_value;
+    setting_is_available_ptr is_available;
+    setting_flags_t flags;
+};
+
+typedef struct {
+    setting_id_t id;
+    const char *description;
+} setting_descr_t;
+
+typedef struct {
+    setting_group_t parent;
+    setting_group_t id;
+    const char *name;
+} setting_group_detail_t;
+
+typedef void (*settings_changed_ptr)(void *settings, uint32_t changed);
+
+typedef struct setting_details {
+    uint8_t n_groups;
+    const setting_group_detail_t *groups;
+    uint16_t n_settings;
+    const setting_detail_t *settings;
+    uint16_t n_descriptions;
+    const setting_descr_t *descriptions;
+    void (*save)(void);
+    void (*load)(void);
+    void (*restore)(void);
+    bool (*iterator)(const setting_detail_t *setting, setting_output_ptr callback, void *data);
+    void (*on_changed)(void *settings, uint32_t changed);
+} setting_details_t;
+
+#define SETTINGS_HARD_RESET_REQUIRED " A hard reset of the controller is required after changing this setting."
+
+void settings_register (setting_details_t *details);
+
+typedef struct {
+    uint8_t mode;
+    struct {
+        uint8_t pin_state;
+    } status_report;
+} settings_t;
+
+extern settings_t settings;
+
+// System commands
+
+typedef status_code_t (*sys_command_ptr)(sys_state_t state, char *args);
+
+typedef union {
+    uint8_t flags;
+    struct {
+        uint8_t noargs         :1,
+                allow_blocking :1,
+                help_fully_documented :1,
+                unused         :5;
+    };
+} sys_command_flags_t;
+
+typedef struct {
+    const char *command;
+    sys_command_ptr execute;
+    sys_command_flags_t flags;
+    struct {
+        const char *str;
+    } help;
+} sys_command_t;
+
+typedef struct sys_commands_str {
+    const uint8_t n_commands;
+    const sys_command_t *commands;
+    struct sys_commands_str *next;
+} sys_commands_t;
+
+void system_register_commands (sys_commands_t *commands);
+
+// Ioports
+
+typedef enum {
+    Port_Analog = 0,
+    Port_Digital
+} io_port_type_t;
+
+typedef enum {
+    Port_Input = 0,
+    Port_Output
+} io_port_direction_t;
+
+typedef enum {
+    IRQ_Mode_None    = 0,
+    IRQ_Mode_Rising  = 1,
+    IRQ_Mode_Falling = 2,
+    IRQ_Mode_Change  = 3
+} pin_irq_mode_t;
+
+typedef enum {
+    PullMode_None = 0,
+    PullMode_Up,
+    PullMode_Down
+} pull_mode_t;
+
+typedef struct {
+    uint8_t debounce  :1,
+            inverted  :1,
+            pull_mode :2;
+} gpio_in_config_t;
+
+typedef struct {
+    uint16_t irq_mode  :4,
+             debounce  :1,
+             claimable :1,
+             unused    :10;
+} pin_cap_t;
+
+typedef struct xbar xbar_t;
+
+typedef bool (*xbar_config_ptr)(xbar_t *pin, gpio_in_config_t *config, bool persistent);
+
+struct xbar {
+    void *port;
+    uint8_t pin;
+    pin_cap_t cap;
+    xbar_config_ptr config;
+};
+
+typedef void (*ioport_interrupt_callback_ptr)(uint8_t port, bool state);
+
+uint8_t ioports_available (io_port_type_t type, io_port_direction_t dir);
+xbar_t *ioport_get_info (io_port_type_t type, io_port_direction_t dir, uint8_t port);
+bool ioport_claim (io_port_type_t type, io_port_direction_t dir, uint8_t *port, const char *description);
+
+// I2C
+
+typedef uint16_t i2c_address_t;
+typedef void (*keycode_callback_ptr)(const char c);
+
+bool i2c_probe (i2c_address_t i2cAddr);
+bool i2c_send (i2c_address_t i2cAddr, uint8_t *buf, size_t size, bool block);
+bool i2c_receive (i2c_address_t i2cAddr, uint8_t *buf, size_t size, bool block);
+void i2c_get_keycode (i2c_address_t i2cAddr, keycode_callback_ptr callback);
+
+// HAL
+
+typedef enum {
+    IRQ_I2C_Strobe = 0
+} irq_type_t;
+
+typedef bool (*irq_callback_ptr)(uint_fast8_t id, bool level);
+typedef void (*delay_callback_ptr)(void);
+typedef void (*coolant_set_state_ptr)(coolant_state_t mode);
+typedef coolant_state_t (*coolant_get_state_ptr)(void);
+typedef void (*driver_reset_ptr)(void);
+
+typedef struct {
+    uint32_t f_step_timer;
+    void (*delay_ms)(uint32_t ms, delay_callback_ptr callback);
+    uint32_t (*get_elapsed_ticks)(void);
+    uint32_t (*get_micros)(void);
+    void (*irq_enable)(void);
+    void (*irq_disable)(void);
+    bool (*irq_claim)(irq_type_t irq, uint_fast8_t id, irq_callback_ptr callback);
+    driver_reset_ptr driver_reset;
+    io_stream_t stream;
+    struct {
+        control_signals_t (*get_state)(void);
+    } control;
+    struct {
+        axes_signals_t (*get_state)(void);
+    } limits;
+    struct {
+        coolant_set_state_ptr set_state;
+        coolant_get_state_ptr get_state;
+    } coolant;
+    struct {
+        bool (*register_interrupt_handler)(uint8_t port, uint8_t irq_mode, ioport_interrupt_callback_ptr interrupt_callback);
+    } port;
+    struct {
+        nvs_transfer_result_t (*memcpy_to_nvs)(uint32_t dest, uint8_t *source, uint32_t size, bool with_checksum);
+        nvs_transfer_result_t (*memcpy_from_nvs)(uint8_t *dest, uint32_t source, uint32_t size, bool with_checksum);
+    } nvs;
+    struct {
+        uint8_t mpg_mode :1,
+                unused   :7;
+    } driver_cap;
+} grbl_hal_t;
+
+extern grbl_hal_t hal;
+
+// Core event hooks
+
+typedef void (*on_state_change_ptr)(sys_state_t state);
+typedef void (*on_report_options_ptr)(bool newopt);
+typedef void (*on_gcode_message_ptr)(char *msg);
+typedef void (*on_wco_changed_ptr)(void);
+typedef void (*on_rt_reports_added_ptr)(report_tracking_flags_t report);
+typedef void (*on_report_handlers_init_ptr)(void);
+typedef bool (*on_spindle_select_ptr)(spindle_ptrs_t *spindle);
+typedef void (*on_control_signals_changed_ptr)(control_signals_t signals);
+typedef status_code_t (*status_message_ptr)(status_code_t status_code);
+typedef message_code_t (*feedback_message_ptr)(message_code_t message_code);
+typedef bool (*enqueue_gcode_ptr)(char *data);
+typedef bool (*enqueue_realtime_command_ptr)(char data);
+
+typedef uint8_t macro_id_t;
+typedef status_code_t (*on_macro_execute_ptr)(macro_id_t macro);
+typedef void (*on_macro_return_ptr)(void);
+
+typedef struct {
+    on_state_change_ptr on_state_change;
+    on_report_options_ptr on_report_options;
+    on_gcode_message_ptr on_gcode_message;
+    on_wco_changed_ptr on_wco_changed;
+    on_rt_reports_added_ptr on_rt_reports_added;
+    on_report_handlers_init_ptr on_report_handlers_init;
+    on_spindle_select_ptr on_spindle_select;
+    on_control_signals_changed_ptr on_control_signals_changed;
+    on_macro_execute_ptr on_macro_execute;
+    on_macro_return_ptr on_macro_return;
+    enqueue_gcode_ptr enqueue_gcode;
+    enqueue_realtime_command_ptr enqueue_realtime_command;
+    struct {
+        status_message_ptr status_message;
+        feedback_message_ptr feedback_message;
+    } report;
+} grbl_t;
+
+extern grbl_t grbl;
+
+// Core state
+
+typedef struct {
+    int32_t position[N_AXIS];
+    overrides_t override;
+    axes_signals_t homed;
+    struct {
+        uint8_t mask;
+    } homing;
+    axes_signals_t tlo_reference_set;
+    bool mpg_mode;
+    struct {
+        uint8_t cycle_start;
+    } report;
+} system_t;
+
+extern system_t sys;
+
+typedef struct {
+    struct {
+        struct {
+            coord_system_id_t id;
+        } coord_system;
+        bool diameter_mode;
+        bool units_imperial;
+    } modal;
+} parser_state_t;
+
+extern parser_state_t gc_state;
+
+sys_state_t state_get (void);
+uint8_t state_get_substate (void);
+float st_get_realtime_rate (void);
+float gc_get_offset (uint_fast8_t idx, bool real_time);
+void system_convert_array_steps_to_mpos (float *position, int32_t *steps);
+axes_signals_t limit_signals_merge (axes_signals_t signals);
+const char *alarms_get_description (alarm_code_t id);
+const char *errors_get_description (status_code_t id);
+spindle_ptrs_t *spindle_get (uint_fast8_t spindle_num);
+void report_warning (void *message);
+void report_plugin (const char *name, const char *version);
+void report_message (const char *msg, uint8_t type);
+char *ftoa (float n, uint8_t decimal_places);
+char *uitoa (uint32_t n);
+status_code_t read_uint (char *line, uint_fast8_t *char_counter, uint32_t *uint_ptr);
+bool isintf (float value);
+void enqueue_feed_override (uint8_t cmd);
+void enqueue_spindle_override (uint8_t cmd);
+void enqueue_coolant_override (uint8_t cmd);
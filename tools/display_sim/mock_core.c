@@ -0,0 +1,386 @@
+/*
+  mock_core.c - simulated grblHAL core for the display simulator
+
+  Part of grblHAL keypad plugins
+
+  Implements the core functions used by the plugins on top of a simulated clock,
+  foreground tasks are run by sim_run_tasks() when due.
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "mock_core.h"
+
+#define SIM_TASKS 64
+#define SIM_COMMANDS 8
+#define SIM_SPINDLE_ACCEL 4000.0f // RPM/s
+
+typedef struct {
+    foreground_task_ptr fn;
+    void *data;
+    uint64_t due;   // us
+    uint32_t seq;
+} sim_task_t;
+
+sim_core_t sim = { .connected = true };
+grbl_hal_t hal;
+grbl_t grbl;
+system_t sys;
+parser_state_t gc_state;
+settings_t settings;
+
+static sim_task_t tasks[SIM_TASKS];
+static uint_fast8_t n_tasks = 0;
+static uint32_t task_seq = 0;
+static sys_commands_t *commands[SIM_COMMANDS];
+static uint_fast8_t n_commands = 0;
+static spindle_param_t spindle_param = { .override_pct = 100 };
+static spindle_ptrs_t spindle = { .param = &spindle_param, .cap.variable = On };
+static float spindle_rpm = 0.0f;        // actual at spindle_us
+static uint64_t spindle_us = 0;
+
+// Foreground tasks
+
+static bool task_add (foreground_task_ptr fn, void *data, uint32_t delay_ms)
+{
+    if(n_tasks == SIM_TASKS) {
+        fprintf(stderr, "sim: task list full\n");
+        return false;
+    }
+
+    tasks[n_tasks].fn = fn;
+    tasks[n_tasks].data = data;
+    tasks[n_tasks].due = sim.us + delay_ms * 1000ULL;
+    tasks[n_tasks++].seq = task_seq++;
+
+    return true;
+}
+
+bool task_add_immediate (foreground_task_ptr fn, void *data)
+{
+    return task_add(fn, data, 0);
+}
+
+bool task_add_delayed (foreground_task_ptr fn, void *data, uint32_t delay_ms)
+{
+    return task_add(fn, data, delay_ms);
+}
+
+void task_delete (foreground_task_ptr fn, void *data)
+{
+    uint_fast8_t idx = n_tasks;
+
+    while(idx--) {
+        if(tasks[idx].fn == fn && (data == NULL || tasks[idx].data == data))
+            tasks[idx] = tasks[--n_tasks];
+    }
+}
+
+bool protocol_enqueue_foreground_task (foreground_task_ptr fn, void *data)
+{
+    return task_add(fn, data, 0);
+}
+
+// Runs due tasks in due time order, tasks added by a task are run in the same call if due.
+void sim_run_tasks (void)
+{
+    int_fast16_t idx, next;
+
+    do {
+        next = -1;
+        for(idx = 0; idx < n_tasks; idx++) {
+            if(tasks[idx].due <= sim.us && (next < 0 || tasks[idx].due < tasks[next].due ||
+                (tasks[idx].due == tasks[next].due && tasks[idx].seq < tasks[next].seq)))
+                next = idx;
+        }
+        if(next >= 0) {
+            sim_task_t task = tasks[next];
+            tasks[next] = tasks[--n_tasks];
+            sim.task_runs++;
+            task.fn(task.data);
+        }
+    } while(next >= 0);
+}
+
+void sim_advance (uint32_t us)
+{
+    sim.us += us;
+}
+
+// HAL
+
+static void delay_ms (uint32_t ms, delay_callback_ptr callback)
+{
+    sim_advance(ms * 1000);
+    if(callback)
+        callback();
+}
+
+static uint32_t get_elapsed_ticks (void)
+{
+    return (uint32_t)(sim.us / 1000);
+}
+
+static uint32_t get_micros (void)
+{
+    return (uint32_t)sim.us;
+}
+
+static void irq_nop (void)
+{
+}
+
+static void stream_write (const char *s)
+{
+    fputs(s, stdout);
+}
+
+static control_signals_t control_get_state (void)
+{
+    return (control_signals_t){0};
+}
+
+static axes_signals_t limits_get_state (void)
+{
+    return (axes_signals_t){0};
+}
+
+static coolant_state_t coolant_get_state (void)
+{
+    return (coolant_state_t){0};
+}
+
+static spindle_state_t spindle_get_state (spindle_ptrs_t *spindle)
+{
+    return spindle->param->state;
+}
+
+// Simulated encoder, the spindle accelerates and decelerates at SIM_SPINDLE_ACCEL.
+static float spindle_actual_rpm (void)
+{
+    float target = spindle_param.state.on ? spindle_param.rpm_overridden : 0.0f,
+          delta = SIM_SPINDLE_ACCEL * (float)(sim.us - spindle_us) / 1e6f;
+
+    return spindle_rpm < target ? min(spindle_rpm + delta, target) : max(spindle_rpm - delta, target);
+}
+
+static spindle_data_t *spindle_get_data (spindle_data_request_t request)
+{
+    static spindle_data_t data;
+
+    sim.rpm_reads++;
+    data.rpm = spindle_actual_rpm();
+
+    return &data;
+}
+
+__attribute__((constructor)) static void sim_core_init (void)
+{
+    hal.delay_ms = delay_ms;
+    hal.get_elapsed_ticks = get_elapsed_ticks;
+    hal.get_micros = get_micros;
+    hal.irq_enable = irq_nop;
+    hal.irq_disable = irq_nop;
+    hal.stream.write = stream_write;
+    hal.control.get_state = control_get_state;
+    hal.limits.get_state = limits_get_state;
+    hal.coolant.get_state = coolant_get_state;
+    spindle.get_state = spindle_get_state;
+    spindle.get_data = spindle_get_data;
+    sys.override.feed_rate = 100;
+    sys.override.rapid_rate = 100;
+    sys.override.spindle_rpm = 100;
+}
+
+// I2C
+
+bool i2c_probe (i2c_address_t i2cAddr)
+{
+    return sim.connected && (sim.i2c_probe == NULL || sim.i2c_probe(i2cAddr));
+}
+
+bool i2c_send (i2c_address_t i2cAddr, uint8_t *buf, size_t size, bool block)
+{
+    return sim.i2c_write == NULL || sim.i2c_write(i2cAddr, buf, size);
+}
+
+bool i2c_receive (i2c_address_t i2cAddr, uint8_t *buf, size_t size, bool block)
+{
+    return sim.i2c_read != NULL && sim.i2c_read(i2cAddr, buf, size);
+}
+
+void i2c_get_keycode (i2c_address_t i2cAddr, keycode_callback_ptr callback)
+{
+}
+
+// Streams
+
+static void sim_stream_write_n (const uint8_t *s, uint16_t len)
+{
+    if(sim.stream_write)
+        sim.stream_write(s, len);
+}
+
+// Output is consumed immediately, the stream is never busy.
+static io_stream_t sim_stream = {
+    .type = StreamType_Serial,
+    .write_n = sim_stream_write_n
+};
+
+const io_stream_t *stream_open_instance (uint8_t instance, uint32_t baud_rate, stream_write_char_ptr rx_handler, const char *description)
+{
+    sim_stream.instance = instance;
+
+    return sim.connected ? &sim_stream : NULL;
+}
+
+// Core
+
+void system_register_commands (sys_commands_t *cmds)
+{
+    if(n_commands < SIM_COMMANDS)
+        commands[n_commands++] = cmds;
+}
+
+// Executes a $ command, given as <command> or <command>=<args>.
+bool sim_execute_command (const char *command)
+{
+    uint_fast8_t idx, cmd;
+    char line[64], *args;
+
+    strncpy(line, command, sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\0';
+
+    if((args = strchr(line, '=')))
+        *args++ = '\0';
+
+    for(idx = 0; idx < n_commands; idx++) {
+        for(cmd = 0; cmd < commands[idx]->n_commands; cmd++) {
+            if(!strcasecmp(commands[idx]->commands[cmd].command, line))
+                return commands[idx]->commands[cmd].execute(sim.state, args) == Status_OK;
+        }
+    }
+
+    return false;
+}
+
+void sim_set_state (sys_state_t state, uint8_t substate)
+{
+    sim.state = state;
+    sim.substate = substate;
+
+    if(grbl.on_state_change)
+        grbl.on_state_change(state);
+}
+
+void sim_set_spindle (float rpm)
+{
+    spindle_rpm = spindle_actual_rpm();
+    spindle_us = sim.us;
+    spindle_param.rpm = spindle_param.rpm_overridden = rpm;
+    spindle_param.state.on = rpm > 0.0f;
+
+    if(grbl.on_rt_reports_added)
+        grbl.on_rt_reports_added((report_tracking_flags_t){ .spindle = On });
+}
+
+sys_state_t state_get (void)
+{
+    return sim.state;
+}
+
+uint8_t state_get_substate (void)
+{
+    return sim.substate;
+}
+
+float st_get_realtime_rate (void)
+{
+    return sim.feed_rate;
+}
+
+float gc_get_offset (uint_fast8_t idx, bool real_time)
+{
+    return idx < N_AXIS ? sim.wco[idx] : 0.0f;
+}
+
+void system_convert_array_steps_to_mpos (float *position, int32_t *steps)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < N_AXIS; idx++)
+        position[idx] = (float)steps[idx] / SIM_STEPS_PER_MM;
+}
+
+axes_signals_t limit_signals_merge (axes_signals_t signals)
+{
+    return signals;
+}
+
+const char *alarms_get_description (alarm_code_t id)
+{
+    return id == 1 ? "Hard limit has been triggered. Machine position is likely lost due to sudden halt." : "Alarm.";
+}
+
+const char *errors_get_description (status_code_t id)
+{
+    return NULL;
+}
+
+spindle_ptrs_t *spindle_get (uint_fast8_t spindle_num)
+{
+    return &spindle;
+}
+
+void report_warning (void *message)
+{
+    fprintf(stderr, "warning: %s\n", (char *)message);
+}
+
+char *ftoa (float n, uint8_t decimal_places)
+{
+    static char buf[32];
+
+    snprintf(buf, sizeof(buf), "%.*f", decimal_places, n);
+
+    return buf;
+}
+
+char *uitoa (uint32_t n)
+{
+    static char buf[16];
+
+    snprintf(buf, sizeof(buf), "%u", n);
+
+    return buf;
+}
+
+status_code_t read_uint (char *line, uint_fast8_t *char_counter, uint32_t *uint_ptr)
+{
+    char *end;
+    unsigned long value = strtoul(line + *char_counter, &end, 10);
+
+    if(end == line + *char_counter || *line == '-')
+        return Status_BadNumberFormat;
+
+    *uint_ptr = (uint32_t)value;
+    *char_counter = (uint_fast8_t)(end - line);
+
+    return Status_OK;
+}
@@ -0,0 +1,54 @@
+/*
+  mock_core.h - simulated grblHAL core for the display simulator
+
+  Part of grblHAL keypad plugins
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#define SIM_STEPS_PER_MM 1000.0f
+
+// Called for each I2C write and read issued by the plugins, return false to simulate a NAK.
+typedef bool (*sim_i2c_write_ptr)(uint_fast16_t address, const uint8_t *data, size_t len);
+typedef bool (*sim_i2c_read_ptr)(uint_fast16_t address, uint8_t *data, size_t len);
+typedef bool (*sim_i2c_probe_ptr)(uint_fast16_t address);
+// Called for each write to a stream opened by the plugins.
+typedef void (*sim_stream_write_ptr)(const uint8_t *data, size_t len);
+
+typedef struct {
+    uint64_t us;                // simulated time
+    sys_state_t state;
+    uint8_t substate;
+    float feed_rate;            // mm/min, current
+    float wco[N_AXIS];          // work coordinate offsets in effect
+    bool connected;             // false to fail all i2c_probe() and stream_open_instance() calls
+    uint32_t task_runs;         // foreground tasks run
+    uint32_t rpm_reads;         // spindle encoder reads
+    sim_i2c_write_ptr i2c_write;
+    sim_i2c_read_ptr i2c_read;
+    sim_i2c_probe_ptr i2c_probe;
+    sim_stream_write_ptr stream_write;
+} sim_core_t;
+
+extern sim_core_t sim;
+
+void sim_advance (uint32_t us);
+void sim_run_tasks (void);
+void sim_set_state (sys_state_t state, uint8_t substate);
+void sim_set_spindle (float rpm);
+bool sim_execute_command (const char *command);